@@ -0,0 +1,151 @@
+#include "Code.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static bool usesArgs(const Function &f) {
+    for (auto &i: f.code)
+        if (i.a.kind == Operand::Arg) return true;
+    return false;
+}
+
+// peephole pass over one function
+void optimize(Function &f) {
+    auto &code = f.code;
+
+    // nothing after the first ret/jmp is reachable
+    for (size_t i = 0; i < code.size(); ++i)
+        if (code[i].op == Insn::Ret || code[i].op == Insn::Jmp) {
+            code.erase(code.begin() + i + 1, code.end());
+            break;
+        }
+
+    // ebp is only needed to reach the arguments, and the registers that
+    // lowering saves or spills
+    bool frame = usesArgs(f) || f.nregs > 0;
+
+    vector<Insn> out;
+    out.reserve(code.size());
+    for (auto &i: code) {
+        switch (i.op) {
+        case Insn::Enter:
+            if (!frame) continue;
+            break;
+        case Insn::Leave:
+            if (!frame) continue;
+            // leave restores esp anyway
+            while (!out.empty() && out.back().op == Insn::AddEsp)
+                out.pop_back();
+            break;
+        case Insn::AddEsp:
+            if (!out.empty() && out.back().op == Insn::AddEsp) {
+                out.back().n += i.n;
+                if (out.back().n == 0) out.pop_back();
+                continue;
+            }
+            if (i.n == 0) continue;
+            break;
+        default:
+            break;
+        }
+        out.push_back(i);
+    }
+
+    // call X; [leave;] ret -> [leave;] jmp X, when X takes nothing from
+    // our frame; not where our ret has to pop arguments
+    bool pops = calleePops(f.conv, f.nargs) > 0;
+    for (size_t i = 0; !pops && i + 1 < out.size(); ++i) {
+        if (out[i].op != Insn::Call || out[i].n != 0) continue;
+        if (out[i + 1].op == Insn::Ret) {
+            out[i].op = Insn::Jmp;
+            out.erase(out.begin() + i + 1);
+        } else if (i + 2 < out.size() && out[i + 1].op == Insn::Leave
+                && out[i + 2].op == Insn::Ret) {
+            out[i + 1] = Insn(Insn::Jmp, out[i].a);
+            out[i] = Insn(Insn::Leave);
+            out.erase(out.begin() + i + 2);
+        }
+    }
+
+    code.swap(out);
+}
+
+Allocation allocate(const Function &f, int npool, unsigned callclobber,
+                    unsigned divclobber) {
+    auto &code = f.code;
+    Allocation ret;
+    ret.loc.assign(f.nregs, 0);
+    vector<int> start(f.nregs, -1), end(f.nregs, -1);
+    auto use = [&](int r, int i) {
+        start[r] = start[r] < 0 ? i : min(start[r], i);
+        end[r] = max(end[r], i);
+    };
+    // calls[i] and divs[i]: how many come before i
+    vector<int> calls(code.size() + 1), divs(code.size() + 1);
+    int call = code.size();
+    for (int i = code.size() - 1; i >= 0; --i)
+        if (code[i].op == Insn::Call || code[i].op == Insn::Jmp) call = i;
+        else if (code[i].op == Insn::Push && code[i].a.kind == Operand::Reg)
+            use(code[i].a.value, i), use(code[i].a.value, call);
+    for (int i = 0; i < code.size(); ++i) {
+        auto &in = code[i];
+        if (in.a.kind == Operand::Reg) use(in.a.value, i);
+        if (hasDest(in.op)) use(in.n, i);
+        calls[i + 1] = calls[i] + (in.op == Insn::Call || in.op == Insn::Jmp);
+        divs[i + 1] = divs[i] + (in.op == Insn::Div);
+    }
+
+    vector<int> order;
+    for (int r = 0; r < f.nregs; ++r)
+        if (start[r] >= 0) order.push_back(r);
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        return start[a] < start[b];
+    });
+
+    // active intervals hold their pool register; one ending where the
+    // next starts frees it, since an instruction reads before it writes
+    vector<int> active;
+    unsigned busy = 0;
+    for (int r: order) {
+        for (size_t k = 0; k < active.size();)
+            if (end[active[k]] <= start[r]) {
+                busy &= ~(1u << ret.loc[active[k]]);
+                active[k] = active.back();
+                active.pop_back();
+            } else
+                ++k;
+        unsigned allowed = (npool < 32 ? (1u << npool) : 0u) - 1;
+        if (calls[end[r]] > calls[start[r] + 1]) allowed &= ~callclobber;
+        if (divs[end[r] + 1] > divs[start[r]]) allowed &= ~divclobber;
+
+        int reg = -1;
+        for (int p = 0; p < npool && reg < 0; ++p)
+            if ((allowed & ~busy) >> p & 1) reg = p;
+        if (reg < 0) {
+            // the interval that lasts longest gives way
+            int victim = -1;
+            for (int k = 0; k < active.size(); ++k) {
+                int a = active[k];
+                if ((allowed >> ret.loc[a] & 1)
+                        && (victim < 0 || end[a] > end[active[victim]]))
+                    victim = k;
+            }
+            if (victim < 0 || end[active[victim]] <= end[r]) {
+                ret.loc[r] = ~ret.spills++;
+                continue;
+            }
+            int a = active[victim];
+            reg = ret.loc[a];
+            ret.loc[a] = ~ret.spills++;
+            active[victim] = active.back();
+            active.pop_back();
+            busy &= ~(1u << reg);
+        }
+        ret.loc[r] = reg;
+        ret.used |= 1u << reg;
+        busy |= 1u << reg;
+        active.push_back(r);
+    }
+    return ret;
+}
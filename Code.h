@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// instruction operand; labels are module-local label ids, and registers
+// are virtual ones of the function until lowering allocates them
+struct Operand {
+    enum Kind { None, Imm, Label, Arg, Reg };
+    Kind kind = None;
+    int value = 0;
+
+    static Operand imm(int v) { return { Imm, v }; }
+    static Operand label(int id) { return { Label, id }; }
+    static Operand arg(int i) { return { Arg, i }; }
+    static Operand reg(int r) { return { Reg, r }; }
+};
+
+// x86 instruction before encoding
+struct Insn {
+    enum Op {
+        Enter,  // push ebp; mov ebp, esp
+        Leave,
+        Ret,
+        Push,   // push a
+        Call,   // call a, n = number of arguments
+        Jmp,    // jmp a
+        AddEsp, // add esp, n
+        MovEax, // mov eax, a
+        // 32-bit integers in virtual register n; never a label but in Mov,
+        // never an immediate divisor
+        Mov,    // n = a
+        Add,    // n += a
+        Sub,    // n -= a
+        Mul,    // n *= a
+        Div,    // n /= a, signed
+        SetEq,  // n = n == a
+        SetNe,  // n = n != a
+        SetLt,  // n = n < a, signed as the rest
+        SetLe,  // n = n <= a
+        SetGt,  // n = n > a
+        SetGe,  // n = n >= a
+        Result, // n = eax, the value of the last call
+    };
+    Op op;
+    Operand a;
+    int n;
+
+    Insn(Op op, Operand a = Operand(), int n = 0): op(op), a(a), n(n) {}
+};
+
+// i386 calling conventions; x86-64 has one per ABI and ignores them.
+// stdcall and fastcall callees pop their stack arguments, and fastcall
+// passes the first two in ecx and edx
+enum Conv { Cdecl, Stdcall, Fastcall };
+
+// arguments of a call that travel in registers, and the bytes of the
+// others that the callee pops
+inline int regArgs(Conv c, int nargs) {
+    return c == Fastcall ? (nargs < 2 ? nargs : 2) : 0;
+}
+inline int calleePops(Conv c, int nargs) {
+    return c == Cdecl ? 0 : 4 * (nargs - regArgs(c, nargs));
+}
+
+struct Function {
+    std::string name;
+    int label;
+    Conv conv = Cdecl;
+    int nargs = 0;
+    int nregs = 0; // virtual registers, locals included
+    std::vector<Insn> code;
+};
+
+inline bool hasDest(Insn::Op op) { return op >= Insn::Mov; }
+
+void optimize(Function &f);
+
+// where lowering keeps the virtual registers of a function: loc is the
+// index of a register in the target's pool, or ~k for spill slot k
+struct Allocation {
+    std::vector<int> loc;
+    int spills = 0;
+    unsigned used = 0; // pool registers assigned, as a bit mask
+};
+
+// linear scan over the live intervals of f's registers, which are exact
+// as code has no branches. The pool has npool registers in order of
+// preference; one that is live across a call may not be in callclobber,
+// nor in divclobber if a division uses it or happens while it is live.
+// Pushed operands count as used by their call, where x86-64 reads them
+Allocation allocate(const Function &f, int npool, unsigned callclobber,
+                    unsigned divclobber);
@@ -0,0 +1,344 @@
+#include "ELF.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// an address or offset: 4 bytes in ELF32, 8 in ELF64
+static void word(Buffer &b, DWORD v, bool wide) {
+    b << u4(v);
+    if (wide) b << u4(0);
+}
+
+static void put(Buffer &b, const Elf32_Ehdr &h, bool wide) {
+    b.add(h.e_ident, sizeof(h.e_ident));
+    b << u2(h.e_type) << u2(h.e_machine) << u4(h.e_version);
+    word(b, h.e_entry, wide);
+    word(b, h.e_phoff, wide);
+    word(b, h.e_shoff, wide);
+    b << u4(h.e_flags)
+      << u2(h.e_ehsize) << u2(h.e_phentsize) << u2(h.e_phnum)
+      << u2(h.e_shentsize) << u2(h.e_shnum) << u2(h.e_shstrndx);
+}
+
+static void put(Buffer &b, const Elf32_Phdr &h, bool wide) {
+    b << u4(h.p_type);
+    if (wide) b << u4(h.p_flags);
+    word(b, h.p_offset, wide);
+    word(b, h.p_vaddr, wide);
+    word(b, h.p_paddr, wide);
+    word(b, h.p_filesz, wide);
+    word(b, h.p_memsz, wide);
+    if (!wide) b << u4(h.p_flags);
+    word(b, h.p_align, wide);
+}
+
+static void put(Buffer &b, const Elf32_Shdr &h, bool wide) {
+    b << u4(h.sh_name) << u4(h.sh_type);
+    word(b, h.sh_flags, wide);
+    word(b, h.sh_addr, wide);
+    word(b, h.sh_offset, wide);
+    word(b, h.sh_size, wide);
+    b << u4(h.sh_link) << u4(h.sh_info);
+    word(b, h.sh_addralign, wide);
+    word(b, h.sh_entsize, wide);
+}
+
+// cdecl replacements for the C library functions that programs import,
+// calling the kernel directly through int 0x80; ebx is callee-saved
+static const map<string, vector<BYTE>> builtins32 = {
+    { "puts", {
+        0x53,                         // push ebx
+        0x8b, 0x4c, 0x24, 0x08,       // mov ecx, [esp+8]
+        0x89, 0xca,                   // mov edx, ecx
+        0x80, 0x3a, 0x00,             // cmp byte [edx], 0
+        0x74, 0x03,                   // je $+5
+        0x42,                         // inc edx
+        0xeb, 0xf8,                   // jmp $-6
+        0x29, 0xca,                   // sub edx, ecx
+        0xbb, 0x01, 0x00, 0x00, 0x00, // mov ebx, 1 (stdout)
+        0xb8, 0x04, 0x00, 0x00, 0x00, // mov eax, 4 (write)
+        0xcd, 0x80,                   // int 0x80
+        0x6a, 0x0a,                   // push '\n'
+        0x89, 0xe1,                   // mov ecx, esp
+        0xba, 0x01, 0x00, 0x00, 0x00, // mov edx, 1
+        0xb8, 0x04, 0x00, 0x00, 0x00, // mov eax, 4 (write)
+        0xcd, 0x80,                   // int 0x80
+        0x58,                         // pop eax
+        0x31, 0xc0,                   // xor eax, eax
+        0x5b,                         // pop ebx
+        0xc3,                         // ret
+    }},
+    { "putchar", {
+        0x53,                         // push ebx
+        0x8d, 0x4c, 0x24, 0x08,       // lea ecx, [esp+8]
+        0xba, 0x01, 0x00, 0x00, 0x00, // mov edx, 1
+        0xbb, 0x01, 0x00, 0x00, 0x00, // mov ebx, 1 (stdout)
+        0xb8, 0x04, 0x00, 0x00, 0x00, // mov eax, 4 (write)
+        0xcd, 0x80,                   // int 0x80
+        0x0f, 0xb6, 0x44, 0x24, 0x08, // movzx eax, byte [esp+8]
+        0x5b,                         // pop ebx
+        0xc3,                         // ret
+    }},
+    { "getchar", {
+        0x53,                         // push ebx
+        0x6a, 0x00,                   // push 0
+        0x89, 0xe1,                   // mov ecx, esp
+        0xba, 0x01, 0x00, 0x00, 0x00, // mov edx, 1
+        0x31, 0xdb,                   // xor ebx, ebx (stdin)
+        0xb8, 0x03, 0x00, 0x00, 0x00, // mov eax, 3 (read)
+        0xcd, 0x80,                   // int 0x80
+        0x83, 0xf8, 0x01,             // cmp eax, 1
+        0x58,                         // pop eax
+        0x74, 0x03,                   // je $+5
+        0x83, 0xc8, 0xff,             // or eax, -1 (EOF)
+        0x5b,                         // pop ebx
+        0xc3,                         // ret
+    }},
+    { "exit", {
+        0x8b, 0x5c, 0x24, 0x04,       // mov ebx, [esp+4]
+        0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1 (exit)
+        0xcd, 0x80,                   // int 0x80
+    }},
+};
+
+// the same for x86-64 with the System V convention and syscall
+static const map<string, vector<BYTE>> builtins64 = {
+    { "puts", {
+        0x48, 0x89, 0xfe,             // mov rsi, rdi
+        0x48, 0x89, 0xfa,             // mov rdx, rdi
+        0x80, 0x3a, 0x00,             // cmp byte [rdx], 0
+        0x74, 0x05,                   // je $+7
+        0x48, 0xff, 0xc2,             // inc rdx
+        0xeb, 0xf6,                   // jmp $-8
+        0x48, 0x29, 0xf2,             // sub rdx, rsi
+        0xbf, 0x01, 0x00, 0x00, 0x00, // mov edi, 1 (stdout)
+        0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1 (write)
+        0x0f, 0x05,                   // syscall
+        0x6a, 0x0a,                   // push '\n'
+        0x48, 0x89, 0xe6,             // mov rsi, rsp
+        0xba, 0x01, 0x00, 0x00, 0x00, // mov edx, 1
+        0xbf, 0x01, 0x00, 0x00, 0x00, // mov edi, 1 (stdout)
+        0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1 (write)
+        0x0f, 0x05,                   // syscall
+        0x58,                         // pop rax
+        0x31, 0xc0,                   // xor eax, eax
+        0xc3,                         // ret
+    }},
+    { "putchar", {
+        0x57,                         // push rdi
+        0x48, 0x89, 0xe6,             // mov rsi, rsp
+        0xba, 0x01, 0x00, 0x00, 0x00, // mov edx, 1
+        0xbf, 0x01, 0x00, 0x00, 0x00, // mov edi, 1 (stdout)
+        0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1 (write)
+        0x0f, 0x05,                   // syscall
+        0x58,                         // pop rax
+        0x0f, 0xb6, 0xc0,             // movzx eax, al
+        0xc3,                         // ret
+    }},
+    { "getchar", {
+        0x6a, 0x00,                   // push 0
+        0x48, 0x89, 0xe6,             // mov rsi, rsp
+        0xba, 0x01, 0x00, 0x00, 0x00, // mov edx, 1
+        0x31, 0xff,                   // xor edi, edi (stdin)
+        0x31, 0xc0,                   // xor eax, eax (read)
+        0x0f, 0x05,                   // syscall
+        0x83, 0xf8, 0x01,             // cmp eax, 1
+        0x58,                         // pop rax
+        0x74, 0x03,                   // je $+5
+        0x83, 0xc8, 0xff,             // or eax, -1 (EOF)
+        0xc3,                         // ret
+    }},
+    { "exit", {
+        0xb8, 0x3c, 0x00, 0x00, 0x00, // mov eax, 60 (exit)
+        0x0f, 0x05,                   // syscall
+    }},
+};
+
+ELF::ELF(Abi abi): Image(abi)
+{
+    init();
+}
+
+void ELF::init() {
+    clear();
+    stubs.clear();
+    imports.clear();
+
+    sections.push_back(Section(".text",
+        IMAGE_SCN_CNT_CODE | IMAGE_SCN_CNT_INITIALIZED_DATA |
+        IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ));
+    sections.push_back(Section(".rodata",
+        IMAGE_SCN_CNT_INITIALIZED_DATA |
+        IMAGE_SCN_MEM_READ));
+    sections.push_back(Section(".data",
+        IMAGE_SCN_CNT_INITIALIZED_DATA |
+        IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE));
+    sections.push_back(Section(".bss",
+        IMAGE_SCN_CNT_UNINITIALIZED_DATA |
+        IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE));
+
+    text  = section(".text");
+    rdata = section(".rodata");
+    data  = section(".data");
+    bss   = section(".bss");
+
+    base = wide() ? 0x400000 : 0x08048000;
+
+    memset(&eh, 0, sizeof(eh));
+    eh.e_ident[0] = 0x7f;
+    eh.e_ident[1] = 'E';
+    eh.e_ident[2] = 'L';
+    eh.e_ident[3] = 'F';
+    eh.e_ident[4] = wide() ? ELFCLASS64 : ELFCLASS32;
+    eh.e_ident[5] = ELFDATA2LSB;
+    eh.e_ident[6] = EV_CURRENT;
+    eh.e_ident[7] = ELFOSABI_SYSV;
+    eh.e_type = ET_EXEC;
+    eh.e_machine = wide() ? EM_X86_64 : EM_386;
+    eh.e_version = EV_CURRENT;
+    eh.e_ehsize = wide() ? ELF64_EHDR_SIZE : sizeof(Elf32_Ehdr);
+    eh.e_phentsize = wide() ? ELF64_PHDR_SIZE : sizeof(Elf32_Phdr);
+    eh.e_shentsize = wide() ? ELF64_SHDR_SIZE : sizeof(Elf32_Shdr);
+}
+
+void ELF::link() {
+    literals();
+    *text << stubs;
+    stubs.clear();
+    relax();
+    Phase phase("link");
+
+    sects.clear();
+    phdrs.clear();
+    shdrs.clear();
+    shstrtab.clear();
+    for (auto &sect: sections)
+        if (sect.size() > 0) sects.push_back(&sect);
+
+    // one segment per section, each starting on a page of its own at the
+    // same page offset as in the file, so the kernel maps it in place
+    DWORD off = eh.e_ehsize + eh.e_phentsize * sects.size();
+    DWORD addr = base;
+    shstrtab << BYTE(0);
+    shdrs.push_back(Elf32_Shdr {});
+    for (auto sect: sects) {
+        auto size = sect->size();
+        auto ch = sect->h.Characteristics;
+        off = ::align(off, 16);
+        addr = ::align(addr, 0x1000) + off % 0x1000;
+        sect->reloc(base, addr - base);
+        sect->h.VirtualAddress = addr - base;
+        sect->h.Misc.VirtualSize = size;
+        if (sect == text) eh.e_entry = addr;
+
+        Elf32_Phdr ph {};
+        ph.p_type = PT_LOAD;
+        ph.p_offset = off;
+        ph.p_vaddr = ph.p_paddr = addr;
+        ph.p_filesz = sect->bss() ? 0 : size;
+        ph.p_memsz = size;
+        ph.p_flags = PF_R;
+        if (ch & IMAGE_SCN_MEM_WRITE) ph.p_flags |= PF_W;
+        if (ch & IMAGE_SCN_MEM_EXECUTE) ph.p_flags |= PF_X;
+        ph.p_align = 0x1000;
+        phdrs.push_back(ph);
+
+        Elf32_Shdr sh {};
+        sh.sh_name = shstrtab.size();
+        shstrtab << sect->name;
+        sh.sh_type = sect->bss() ? SHT_NOBITS : SHT_PROGBITS;
+        sh.sh_flags = SHF_ALLOC;
+        if (ch & IMAGE_SCN_MEM_WRITE) sh.sh_flags |= SHF_WRITE;
+        if (ch & IMAGE_SCN_MEM_EXECUTE) sh.sh_flags |= SHF_EXECINSTR;
+        sh.sh_addr = addr;
+        sh.sh_offset = off;
+        sh.sh_size = size;
+        sh.sh_addralign = 16;
+        shdrs.push_back(sh);
+
+        off += ph.p_filesz;
+        addr += size;
+    }
+
+    Elf32_Shdr sh {};
+    sh.sh_name = shstrtab.size();
+    shstrtab << ".shstrtab";
+    sh.sh_type = SHT_STRTAB;
+    sh.sh_offset = off;
+    sh.sh_size = shstrtab.size();
+    sh.sh_addralign = 1;
+    shdrs.push_back(sh);
+
+    eh.e_phoff = eh.e_ehsize;
+    eh.e_phnum = phdrs.size();
+    eh.e_shoff = ::align(off + shstrtab.size(), wide() ? 8 : 4);
+    eh.e_shnum = shdrs.size();
+    eh.e_shstrndx = shdrs.size() - 1;
+    filesize = eh.e_shoff + eh.e_shentsize * eh.e_shnum;
+
+    if (stats.enabled()) {
+        stats.count("imports", imports.size());
+        for (auto sect: sects) {
+            stats.count("relocations", sect->relocs());
+            stats.count("labels", sect->labels());
+        }
+    }
+}
+
+void ELF::render(BYTE *out) {
+    Buffer header;
+    put(header, eh, wide());
+    for (auto &ph: phdrs) put(header, ph, wide());
+    header.copy(out);
+    if (stats.enabled()) stats.count("bytes.headers", header.size());
+
+    for (int i = 0; i < sects.size(); ++i) {
+        auto sect = sects[i];
+        if (sect->bss()) continue;
+        sect->copy(out + phdrs[i].p_offset);
+        if (stats.enabled())
+            stats.count("bytes" + sect->name, sect->size());
+    }
+
+    shstrtab.copy(out + shdrs.back().sh_offset);
+    Buffer table;
+    for (auto &sh: shdrs) put(table, sh, wide());
+    table.copy(out + eh.e_shoff);
+}
+
+// a data slot per function, like an import address table entry, so that
+// code calls built-ins the same way as DLL imports
+Address ELF::import(const string &dll, const string &sym) {
+    int id = names.intern(sym);
+    if (auto slot = imports.find(id)) return *slot;
+
+    auto ad = stub(sym);
+    if (!ad) return Address();
+    auto ret = data->addr();
+    imports[id] = ret;
+    *data << Address(ad, wide() ? Abs64 : Abs);
+    return ret;
+}
+
+vector<Import> ELF::slots() const {
+    vector<Import> ret;
+    ret.reserve(imports.size());
+    for (auto &imp: imports)
+        ret.push_back({ "", names.str(imp.first), imp.second });
+    sort(ret.begin(), ret.end(), [](const Import &a, const Import &b) {
+        return a.sym < b.sym;
+    });
+    return ret;
+}
+
+Address ELF::stub(const string &sym) {
+    auto &builtins = wide() ? builtins64 : builtins32;
+    auto it = builtins.find(sym);
+    if (it == builtins.end()) return Address();
+    auto ret = stubs.addr();
+    stubs.add(it->second.data(), it->second.size());
+    return ret;
+}
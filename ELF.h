@@ -0,0 +1,28 @@
+#pragma once
+
+#include "PELib.h"
+#include "ELFFormat.h"
+
+// Linux i386 or x86-64 executable; imports are bound to built-in stubs
+// that make the system calls themselves, so the output needs neither
+// libc nor a dynamic loader
+class ELF: public Image {
+private:
+    DWORD base;
+    Elf32_Ehdr eh;
+    std::vector<Elf32_Phdr> phdrs;
+    std::vector<Elf32_Shdr> shdrs;
+    Buffer shstrtab, stubs;
+    HashMap<int, Address> imports; // by interned name
+
+public:
+    ELF(Abi abi = I386);
+    void init();
+    void link() override;
+    Address import(const std::string &dll, const std::string &sym) override;
+    std::vector<Import> slots() const override;
+
+private:
+    Address stub(const std::string &sym);
+    void render(BYTE *out) override;
+};
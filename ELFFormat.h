@@ -0,0 +1,88 @@
+#pragma once
+
+// ELF structures with the layout and names of <elf.h>, so that the
+// compiler builds on any host. Like PEFormat.h, these are serialized
+// field by field in little-endian order by ELF.cpp, which also writes
+// the ELF64 headers from them: addresses and offsets stay below 4 GB,
+// so only the field widths and the order of p_flags differ.
+
+#include "PEFormat.h"
+
+typedef uint16_t Elf32_Half;
+typedef uint32_t Elf32_Word;
+typedef uint32_t Elf32_Addr;
+typedef uint32_t Elf32_Off;
+
+#define EI_NIDENT 16
+
+struct Elf32_Ehdr {
+    BYTE e_ident[EI_NIDENT];
+    Elf32_Half e_type;
+    Elf32_Half e_machine;
+    Elf32_Word e_version;
+    Elf32_Addr e_entry;
+    Elf32_Off e_phoff;
+    Elf32_Off e_shoff;
+    Elf32_Word e_flags;
+    Elf32_Half e_ehsize;
+    Elf32_Half e_phentsize;
+    Elf32_Half e_phnum;
+    Elf32_Half e_shentsize;
+    Elf32_Half e_shnum;
+    Elf32_Half e_shstrndx;
+};
+
+struct Elf32_Phdr {
+    Elf32_Word p_type;
+    Elf32_Off p_offset;
+    Elf32_Addr p_vaddr;
+    Elf32_Addr p_paddr;
+    Elf32_Word p_filesz;
+    Elf32_Word p_memsz;
+    Elf32_Word p_flags;
+    Elf32_Word p_align;
+};
+
+struct Elf32_Shdr {
+    Elf32_Word sh_name;
+    Elf32_Word sh_type;
+    Elf32_Word sh_flags;
+    Elf32_Addr sh_addr;
+    Elf32_Off sh_offset;
+    Elf32_Word sh_size;
+    Elf32_Word sh_link;
+    Elf32_Word sh_info;
+    Elf32_Word sh_addralign;
+    Elf32_Word sh_entsize;
+};
+
+static_assert(sizeof(Elf32_Ehdr) == 52, "Elf32_Ehdr");
+static_assert(sizeof(Elf32_Phdr) == 32, "Elf32_Phdr");
+static_assert(sizeof(Elf32_Shdr) == 40, "Elf32_Shdr");
+
+// sizes of Elf64_Ehdr, Elf64_Phdr and Elf64_Shdr in the file
+#define ELF64_EHDR_SIZE 64
+#define ELF64_PHDR_SIZE 56
+#define ELF64_SHDR_SIZE 64
+
+#define ELFCLASS32    1
+#define ELFCLASS64    2
+#define ELFDATA2LSB   1
+#define EV_CURRENT    1
+#define ELFOSABI_SYSV 0
+
+#define ET_EXEC       2
+#define EM_386        3
+#define EM_X86_64     62
+
+#define PT_LOAD       1
+#define PF_X          1
+#define PF_W          2
+#define PF_R          4
+
+#define SHT_PROGBITS  1
+#define SHT_STRTAB    3
+#define SHT_NOBITS    8
+#define SHF_WRITE     0x1
+#define SHF_ALLOC     0x2
+#define SHF_EXECINSTR 0x4
@@ -0,0 +1,183 @@
+#pragma once
+
+// x86 instruction forms as constexpr data, and an encoder that the
+// compiler specializes for each of them: the emitters of PELib.cpp pick
+// a form and hand it the operands, and encode<F>() checks the room in
+// the text once and writes the whole instruction into it in place.
+// Everything that depends only on the form is resolved at compile time.
+
+#include "PELib.h"
+
+namespace x86 {
+
+// where the operands go
+enum Mode {
+    Plain,  // opcode bytes only
+    OpReg,  // rm in the low 3 bits of the last opcode byte
+    RegReg, // ModRM with mod 11: reg (or the digit) and rm
+    RegMem, // ModRM with a base register and the shortest displacement
+    Abs32,  // ModRM 00 101 with a 32-bit absolute address (Ptr)
+    RipRel, // ModRM 00 101 in 64-bit mode: a rip-relative address
+};
+
+// what follows the ModRM bytes
+enum Imm { NoImm, Imm8, Imm16, Imm32, ImmAbs, ImmRel };
+
+struct Form {
+    BYTE len;    // opcode bytes
+    BYTE op[3];
+    Mode mode;
+    int digit;   // the ModRM reg field of /digit forms, -1 for a register
+    Imm imm;
+    bool w;      // REX.W: a 64-bit operand size
+    bool rex;    // REX.R/B for r8-r15 where needed; off for i386-only forms
+};
+
+constexpr Form form(BYTE op, Mode mode, int digit = -1, Imm imm = NoImm, bool rex = true, bool w = false) {
+    return { 1, { op, 0, 0 }, mode, digit, imm, w, rex };
+}
+constexpr Form form2(BYTE op, Mode mode, int digit = -1, Imm imm = NoImm, bool rex = true, bool w = false) {
+    return { 2, { 0x0f, op, 0 }, mode, digit, imm, w, rex };
+}
+
+// operands of one instruction; each form reads only the ones it has
+struct Operands {
+    int reg = 0;   // ModRM reg field
+    int rm = 0;    // ModRM rm field, the opcode register, or the base
+    int disp = 0;
+    DWORD imm = 0;
+    Address at;    // of Abs32 and RipRel
+    Address ad;    // of ImmAbs and ImmRel
+};
+
+template <const Form &F> inline void encode(const Operands &o) {
+    auto text = curtext;
+    DWORD start = text->size();
+    BYTE *b = text->room(16);
+    int n = 0, atpos = -1, adpos = -1;
+    constexpr bool modrm = F.mode != Plain && F.mode != OpReg;
+    constexpr bool address = F.mode == Abs32 || F.mode == RipRel;
+    int reg = F.digit >= 0 ? F.digit : o.reg;
+
+    if constexpr (F.rex || F.w) {
+        int rex = 0x40 | F.w << 3;
+        if constexpr (modrm) rex |= (reg & 8) >> 1;
+        if constexpr (F.mode != Plain && !address) rex |= (o.rm & 8) >> 3;
+        if (F.w || rex != 0x40) b[n++] = rex;
+    }
+    for (int i = 0; i + 1 < F.len; ++i) b[n++] = F.op[i];
+    if constexpr (F.mode == OpReg)
+        b[n++] = F.op[F.len - 1] + (o.rm & 7);
+    else
+        b[n++] = F.op[F.len - 1];
+
+    if constexpr (F.mode == RegReg) {
+        b[n++] = 0xc0 + ((reg & 7) << 3) + (o.rm & 7);
+    } else if constexpr (F.mode == RegMem) {
+        // [ebp] and [r13] have no mod 00 form; [esp] and [r12] need a SIB
+        int base = o.rm & 7;
+        int mod = o.disp == 0 && base != ebp ? 0
+                : -128 <= o.disp && o.disp < 128 ? 1 : 2;
+        b[n++] = (mod << 6) + ((reg & 7) << 3) + base;
+        if (base == esp) b[n++] = 0x24;
+        if (mod == 1) {
+            b[n++] = BYTE(o.disp);
+        } else if (mod == 2) {
+            for (int i = 0; i < 4; ++i) b[n++] = BYTE(o.disp >> (8 * i));
+        }
+    } else if constexpr (address) {
+        b[n++] = ((reg & 7) << 3) + 5;
+        atpos = n;
+        for (int i = 0; i < 4; ++i) b[n++] = 0;
+    }
+
+    if constexpr (F.imm == Imm8) {
+        b[n++] = BYTE(o.imm);
+    } else if constexpr (F.imm == Imm16) {
+        b[n++] = BYTE(o.imm);
+        b[n++] = BYTE(o.imm >> 8);
+    } else if constexpr (F.imm == Imm32) {
+        for (int i = 0; i < 4; ++i) b[n++] = BYTE(o.imm >> (8 * i));
+    } else if constexpr (F.imm == ImmAbs || F.imm == ImmRel) {
+        adpos = n;
+        for (int i = 0; i < 4; ++i) b[n++] = 0;
+    }
+
+    // an instruction is at most 15 bytes; the relocations are recorded
+    // in offset order, as Buffer keeps them
+    text->commit(n);
+    if constexpr (F.mode == Abs32)
+        text->field(start + atpos, o.at);
+    else if constexpr (F.mode == RipRel)
+        text->field(start + atpos, Address(o.at, Rel));
+    if constexpr (F.imm == ImmAbs)
+        text->field(start + adpos, o.ad);
+    else if constexpr (F.imm == ImmRel)
+        text->field(start + adpos, Address(o.ad, Rel));
+}
+
+// 8-bit immediates are sign-extended
+inline bool imm8(DWORD v) { return v < 128 || v >= 0xffffff80; }
+
+// the forms the emitters use, by mnemonic and operands: r register,
+// m base + displacement, p absolute address, i immediate, a address
+constexpr Form MOV_RR   = form(0x89, RegReg);
+constexpr Form MOV_RM   = form(0x8b, RegMem);
+constexpr Form MOV_MR   = form(0x89, RegMem);
+constexpr Form MOV_RI   = form(0xb8, OpReg, -1, Imm32);
+constexpr Form MOV_RA   = form(0xb8, OpReg, -1, ImmAbs, false);
+constexpr Form MOV_EAXP = form(0xa1, Plain, -1, ImmAbs, false);
+constexpr Form MOV_PEAX = form(0xa3, Plain, -1, ImmAbs, false);
+constexpr Form MOV_RP   = form(0x8b, Abs32, -1, NoImm, false);
+constexpr Form MOV_PR   = form(0x89, Abs32, -1, NoImm, false);
+constexpr Form MOV_PI   = form(0xc7, Abs32, 0, Imm32, false);
+constexpr Form MOV_PA   = form(0xc7, Abs32, 0, ImmAbs, false);
+constexpr Form MOV_MI   = form(0xc7, RegMem, 0, Imm32, false);
+constexpr Form ADD_RR   = form(0x01, RegReg);
+constexpr Form ADD_RM   = form(0x03, RegMem);
+constexpr Form ADD_RA   = form(0x81, RegReg, 0, ImmAbs, false);
+constexpr Form SUB_RR   = form(0x29, RegReg);
+constexpr Form SUB_RM   = form(0x2b, RegMem);
+constexpr Form CMP_RR   = form(0x39, RegReg);
+constexpr Form CMP_RM   = form(0x3b, RegMem);
+constexpr Form CMP_EAXI = form(0x3d, Plain, -1, Imm32, false);
+template <int op> constexpr Form ALU_RI8  = form(0x83, RegReg, op, Imm8);
+template <int op> constexpr Form ALU_RI32 = form(0x81, RegReg, op, Imm32);
+constexpr Form IMUL_RR  = form2(0xaf, RegReg);
+constexpr Form IMUL_RM  = form2(0xaf, RegMem);
+constexpr Form IMUL_RRI8  = form(0x6b, RegReg, -1, Imm8);
+constexpr Form IMUL_RRI32 = form(0x69, RegReg, -1, Imm32);
+constexpr Form CDQ      = form(0x99, Plain, -1, NoImm, false);
+constexpr Form IDIV_R   = form(0xf7, RegReg, 7);
+constexpr Form IDIV_M   = form(0xf7, RegMem, 7, NoImm, false);
+template <int cc> constexpr Form SETCC = form2(0x90 + cc, RegReg, 0, NoImm, false);
+constexpr Form MOVZX_RR = form2(0xb6, RegReg);
+constexpr Form PUSH_R   = form(0x50, OpReg, -1, NoImm, false);
+constexpr Form PUSH_I   = form(0x68, Plain, -1, Imm32, false);
+constexpr Form PUSH_A   = form(0x68, Plain, -1, ImmAbs, false);
+constexpr Form PUSH_P   = form(0xff, Abs32, 6, NoImm, false);
+constexpr Form PUSH_M   = form(0xff, RegMem, 6, NoImm, false);
+constexpr Form CALL_P   = form(0xff, Abs32, 2, NoImm, false);
+constexpr Form CALL_A   = form(0xe8, Plain, -1, ImmRel, false);
+constexpr Form JMP_P    = form(0xff, Abs32, 4, NoImm, false);
+constexpr Form JMP_A    = form(0xe9, Plain, -1, ImmRel, false);
+template <int cc> constexpr Form JCC_A = form2(0x80 + cc, Plain, -1, ImmRel, false);
+constexpr Form INC_R    = form(0x40, OpReg, -1, NoImm, false);
+constexpr Form NOP      = form(0x90, Plain, -1, NoImm, false);
+constexpr Form RET      = form(0xc3, Plain, -1, NoImm, false);
+constexpr Form RET_I16  = form(0xc2, Plain, -1, Imm16, false);
+constexpr Form LEAVE    = form(0xc9, Plain, -1, NoImm, false);
+
+// x86-64; the 32-bit forms above serve where the encoding is the same
+constexpr Form PUSH_R64 = form(0x50, OpReg);
+constexpr Form POP_R64  = form(0x58, OpReg);
+constexpr Form MOV_RR64 = form(0x89, RegReg, -1, NoImm, true, true);
+constexpr Form MOV_RM64 = form(0x8b, RegMem, -1, NoImm, true, true);
+constexpr Form MOV_MR64 = form(0x89, RegMem, -1, NoImm, true, true);
+constexpr Form LEA_RRIP = form(0x8d, RipRel, -1, NoImm, true, true);
+template <int op> constexpr Form ALU_RI8_64  = form(0x83, RegReg, op, Imm8, true, true);
+template <int op> constexpr Form ALU_RI32_64 = form(0x81, RegReg, op, Imm32, true, true);
+constexpr Form CALL_RIP = form(0xff, RipRel, 2, NoImm, false);
+constexpr Form JMP_RIP  = form(0xff, RipRel, 4, NoImm, false);
+
+}
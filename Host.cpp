@@ -0,0 +1,70 @@
+#include "Host.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+void *mapMemory(size_t size) {
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+void unmapMemory(void *p, size_t size) {
+    VirtualFree(p, 0, MEM_RELEASE);
+}
+
+bool protectMemory(void *p, size_t size, bool write, bool exec) {
+    DWORD prot = exec ? PAGE_EXECUTE_READ : write ? PAGE_READWRITE : PAGE_READONLY;
+    DWORD old;
+    return VirtualProtect(p, size, prot, &old);
+}
+
+void *hostSymbol(const string &dll, const string &sym) {
+    auto h = LoadLibraryA(dll.empty() ? "msvcrt.dll" : dll.c_str());
+    if (!h) return NULL;
+    return reinterpret_cast<void *>(GetProcAddress(h, sym.c_str()));
+}
+#else
+void *mapMemory(size_t size) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+    auto p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void unmapMemory(void *p, size_t size) {
+    munmap(p, size);
+}
+
+bool protectMemory(void *p, size_t size, bool write, bool exec) {
+    int prot = PROT_READ;
+    if (write) prot |= PROT_WRITE;
+    if (exec) prot |= PROT_EXEC;
+    return mprotect(p, size, prot) == 0;
+}
+
+void *hostSymbol(const string &dll, const string &sym) {
+    if (auto p = dlsym(RTLD_DEFAULT, sym.c_str())) return p;
+    // a static build has no dynamic symbols to search, so the functions
+    // that the built-in ELF stubs provide are looked up here as well
+    static const map<string, void *> libc = {
+        { "exit",    reinterpret_cast<void *>(&exit) },
+        { "getchar", reinterpret_cast<void *>(&getchar) },
+        { "putchar", reinterpret_cast<void *>(&putchar) },
+        { "puts",    reinterpret_cast<void *>(&puts) },
+    };
+    auto it = libc.find(sym);
+    return it != libc.end() ? it->second : NULL;
+}
+#endif
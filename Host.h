@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// memory and functions of the process running the compiler, for --run;
+// kept out of JIT.cpp so that <windows.h> never meets PEFormat.h
+
+// read/write pages, below 4 GB where the system allows asking for that
+void *mapMemory(size_t size);
+void unmapMemory(void *p, size_t size);
+bool protectMemory(void *p, size_t size, bool write, bool exec);
+
+// address of a C library or DLL function in this process, or NULL
+void *hostSymbol(const std::string &dll, const std::string &sym);
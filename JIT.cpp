@@ -0,0 +1,79 @@
+#include "JIT.h"
+#include "Host.h"
+
+#include <cstdint>
+
+using namespace std;
+
+static const DWORD page = 0x1000;
+
+JIT::~JIT() {
+    if (mem) unmapMemory(mem, size);
+}
+
+bool JIT::fail(const string &msg) {
+    error = "--run: " + msg;
+    return false;
+}
+
+bool JIT::load(Image &image) {
+    auto &sects = image.linked();
+    for (auto sect: sects)
+        size = max(size, size_t(::align(
+            sect->h.VirtualAddress + sect->h.Misc.VirtualSize, page)));
+
+    // label values are 32-bit, so the image must be mapped below 4 GB
+    abi = image.abi();
+    mem = static_cast<BYTE *>(mapMemory(size));
+    if (!mem) return fail("can not allocate memory");
+    if (uint64_t(uintptr_t(mem)) + size > 0x100000000ULL)
+        return fail("no memory below 4 GB");
+    auto base = DWORD(uintptr_t(mem));
+
+    image.relocate(base);
+    for (auto sect: sects)
+        if (!sect->bss()) sect->copy(mem + sect->h.VirtualAddress);
+
+    for (auto &imp: image.slots()) {
+        auto f = uint64_t(uintptr_t(hostSymbol(imp.dll, imp.sym)));
+        if (!f) return fail("can not resolve import: " + imp.sym);
+        int width = image.wide() ? 8 : 4;
+        if (width == 4 && f > 0xffffffffULL)
+            return fail("import above 4 GB: " + imp.sym);
+        auto slot = mem + (*imp.slot - base);
+        for (int i = 0; i < width; ++i) slot[i] = BYTE(f >> (8 * i));
+    }
+
+    for (auto sect: sects) {
+        auto ch = sect->h.Characteristics;
+        auto start = sect->h.VirtualAddress / page * page;
+        auto end = ::align(sect->h.VirtualAddress + sect->h.Misc.VirtualSize, page);
+        if (!protectMemory(mem + start, end - start,
+                ch & IMAGE_SCN_MEM_WRITE, ch & IMAGE_SCN_MEM_EXECUTE))
+            return fail("can not protect memory");
+    }
+    return true;
+}
+
+// the code must be for this machine and call the host's functions with
+// its convention
+static bool native(Abi abi) {
+#if defined(__i386__) || defined(_M_IX86)
+    return abi == I386;
+#elif defined(_WIN64)
+    return abi == Win64;
+#elif defined(__x86_64__)
+    return abi == SysV;
+#else
+    return false;
+#endif
+}
+
+// entry is an address in the relocated image; _start ends the process
+// through the exit import, so a successful run does not return
+bool JIT::run(DWORD entry) {
+    if (!native(abi))
+        return fail("the target's code can not run on this host");
+    reinterpret_cast<void (*)()>(uintptr_t(entry))();
+    return true;
+}
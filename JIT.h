@@ -0,0 +1,27 @@
+#pragma once
+
+#include "PELib.h"
+
+// runs a linked image inside this process: the sections are copied to
+// memory allocated at run time, relocated for that base address and the
+// import slots bound to functions of the host
+class JIT {
+private:
+    BYTE *mem = nullptr;
+    size_t size = 0;
+    Abi abi = I386;
+
+public:
+    std::string error;
+
+    JIT() {}
+    ~JIT();
+    JIT(const JIT &) = delete;
+    JIT &operator=(const JIT &) = delete;
+
+    bool load(Image &image);
+    bool run(DWORD entry);
+
+private:
+    bool fail(const std::string &msg);
+};
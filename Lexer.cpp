@@ -0,0 +1,136 @@
+#include "Lexer.h"
+
+#include <array>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+Source::Source(const string &path) {
+    if (!map(path)) load(path);
+}
+
+Source::~Source() {
+#ifdef _WIN32
+    if (mapped) UnmapViewOfFile(data);
+    if (hmap) CloseHandle(hmap);
+    if (hfile) CloseHandle(hfile);
+#else
+    if (mapped) munmap(const_cast<char *>(data), length);
+#endif
+}
+
+#ifdef _WIN32
+bool Source::map(const string &path) {
+    auto f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    hfile = f;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(f, &size) || size.QuadPart == 0) return false;
+    hmap = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hmap) return false;
+    auto p = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    if (!p) return false;
+    data = static_cast<const char *>(p);
+    length = size.QuadPart;
+    return mapped = true;
+}
+#else
+bool Source::map(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return false;
+    data = static_cast<const char *>(p);
+    length = st.st_size;
+    return mapped = true;
+}
+#endif
+
+bool Source::load(const string &path) {
+    auto f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        buffer.append(buf, n);
+    fclose(f);
+    data = buffer.data();
+    length = buffer.size();
+    return true;
+}
+
+static constexpr array<unsigned char, 256> mkctype() {
+    array<unsigned char, 256> t {};
+    for (int ch = 0; ch < 256; ++ch) {
+        if (ch == '_' || ('A' <= ch && ch <= 'Z') || ('a' <= ch && ch <= 'z'))
+            t[ch] |= Lexer::CAlpha;
+        if ('0' <= ch && ch <= '9')
+            t[ch] |= Lexer::CNum;
+        if (ch == '\'')
+            t[ch] |= Lexer::CQuote;
+        if (ch <= ' ')
+            t[ch] |= Lexer::CSpace;
+    }
+    return t;
+}
+
+const array<unsigned char, 256> Lexer::ctype = mkctype();
+
+Lexer::Lexer(const string &src): file(src), src(src) {
+    cur = bol = file.begin();
+    end = file.end();
+}
+
+bool Lexer::read() {
+    while (cur < end) {
+        auto start = cur;
+        auto c = ctype[(unsigned char)*cur];
+        if (c & CSpace) {
+            if (*cur++ == '\n') { ++curline; bol = cur; }
+            continue;
+        }
+        line = curline;
+        column = cur - bol + 1;
+        if (c & CAlpha) {
+            type = Word;
+            while (++cur < end && isletter(*cur));
+        } else if (c & CNum) {
+            type = Num;
+            while (++cur < end && isnum(*cur));
+        } else if (*cur == '"') {
+            type = Str;
+            bool esc = false;
+            while (++cur < end) {
+                char ch = *cur;
+                if (ch == '\n') { ++curline; bol = cur + 1; }
+                if (esc)
+                    esc = false;
+                else if (ch == '"') {
+                    ++cur;
+                    break;
+                } else if (ch == '\\')
+                    esc = true;
+            }
+        } else {
+            type = Other;
+            ++cur;
+        }
+        token = string_view(start, cur - start);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+
+// whole source file, memory-mapped when possible
+class Source {
+private:
+    const char *data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string buffer;
+#ifdef _WIN32
+    void *hfile = nullptr, *hmap = nullptr;
+#endif
+
+public:
+    Source(const std::string &path);
+    ~Source();
+    Source(const Source &) = delete;
+    Source &operator=(const Source &) = delete;
+
+    inline const char *begin() const { return data; }
+    inline const char *end() const { return data + length; }
+    inline size_t size() const { return length; }
+
+private:
+    bool map(const std::string &path);
+    bool load(const std::string &path);
+};
+
+enum Token { Word, Num, Str, Other };
+
+class Lexer {
+public:
+    // character classes, looked up through a 256-entry table
+    enum { CAlpha = 1, CNum = 2, CQuote = 4, CSpace = 8 };
+    static const std::array<unsigned char, 256> ctype;
+
+private:
+    Source file;
+    const char *cur, *end, *bol;
+    int curline = 1;
+
+public:
+    std::string src;
+    Token type = Other;
+    std::string_view token;
+    int line = 1, column = 0;
+
+    Lexer(const std::string &src);
+
+    static inline bool isalpha(char ch) {
+        return ctype[(unsigned char)ch] & CAlpha;
+    }
+
+    static inline bool isnum(char ch) {
+        return ctype[(unsigned char)ch] & CNum;
+    }
+
+    static inline bool isletter(char ch) {
+        return ctype[(unsigned char)ch] & (CAlpha | CNum | CQuote);
+    }
+
+    bool read();
+};
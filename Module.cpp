@@ -0,0 +1,901 @@
+#include "Module.h"
+
+using namespace std;
+
+Module::Module(const string &src): src(src) {}
+
+void Module::select() {
+    curtext = &text;
+    curlabels = &labels;
+}
+
+Address Module::external(Kind kind, const string &name, const string &dll,
+                         int line, int column, const string &src) {
+    Address ret(0);
+    externs.push_back({ kind, name, dll, src, ret.id, line, column });
+    return ret;
+}
+
+// src is given when the reference was copied from another module
+Address Module::func(const string &name, int line, int column,
+                     const string &src) {
+    auto r = funcs.insert(names.intern(name));
+    if (!r.second) return Address::label(*r.first);
+    auto ret = external(Func, name, "", line, column, src);
+    *r.first = ret.id;
+    return ret;
+}
+
+Address Module::str(const string &s) {
+    auto r = strs.insert(names.intern(s));
+    if (!r.second) return Address::label(*r.first);
+    auto ret = external(Str, s, "", 0, 0);
+    *r.first = ret.id;
+    return ret;
+}
+
+void Module::import(const string &dll, const string &sym, Conv conv) {
+    imported.push_back({ sym, dll, conv });
+}
+
+Address Module::iat(const string &dll, const string &sym) {
+    auto r = iats.insert(pairKey(names.intern(dll), names.intern(sym)));
+    if (!r.second) return Address::label(*r.first);
+    auto ret = external(Import, sym, dll, 0, 0);
+    *r.first = ret.id;
+    return ret;
+}
+
+void Module::function(const string &name) {
+    functions.emplace_back();
+    auto &f = functions.back();
+    f.name = name;
+    f.label = func(name).id;
+}
+
+namespace {
+
+// little-endian words and length-prefixed strings
+struct Writer {
+    string &out;
+
+    void num(DWORD v) {
+        for (int i = 0; i < 4; ++i) out += char(v >> (8 * i));
+    }
+    void str(const string &s) {
+        num(s.size());
+        out += s;
+    }
+};
+
+struct Reader {
+    const string &in;
+    size_t pos = 0;
+    bool ok = true;
+
+    DWORD num() {
+        if (pos + 4 > in.size()) { ok = false; return 0; }
+        DWORD v = 0;
+        for (int i = 0; i < 4; ++i) v |= DWORD(BYTE(in[pos++])) << (8 * i);
+        return v;
+    }
+    string str() {
+        auto n = num();
+        if (!ok || pos + n > in.size()) { ok = false; return string(); }
+        pos += n;
+        return in.substr(pos - n, n);
+    }
+    // counts are bounded by what is left, so that bad data can not make
+    // a reader allocate without limit
+    size_t count(size_t minsize) {
+        auto n = num();
+        if (n > (in.size() - pos) / minsize) ok = false;
+        return ok ? n : 0;
+    }
+};
+
+}
+
+// bump when the layout below or the IR changes
+static const char magic[] = "inc-module-4";
+
+void Module::save(string &out) const {
+    Writer w { out };
+    w.str(magic);
+    w.str(src);
+    w.num(tokens);
+    w.num(calls);
+    w.num(labels.size());
+    for (auto v: labels) w.num(v);
+    w.num(externs.size());
+    for (auto &e: externs) {
+        w.num(e.kind);
+        w.str(e.name);
+        w.str(e.dll);
+        w.str(e.src);
+        w.num(e.label);
+        w.num(e.line);
+        w.num(e.column);
+    }
+    w.num(imported.size());
+    for (auto &imp: imported) {
+        w.str(imp.sym);
+        w.str(imp.dll);
+        w.num(imp.conv);
+    }
+    w.num(functions.size());
+    for (auto &f: functions) {
+        w.str(f.name);
+        w.num(f.label);
+        w.num(f.conv);
+        w.num(f.nargs);
+        w.num(f.nregs);
+        w.num(f.code.size());
+        for (auto &i: f.code) {
+            w.num(i.op);
+            w.num(i.a.kind);
+            w.num(i.a.value);
+            w.num(i.n);
+        }
+    }
+}
+
+bool Module::load(const string &in) {
+    Reader r { in };
+    if (r.str() != magic) return false;
+    auto path = r.str();
+    tokens = r.num();
+    calls = r.num();
+    labels.resize(r.count(4));
+    for (auto &v: labels) v = r.num();
+    externs.resize(r.count(24));
+    for (auto &e: externs) {
+        e.kind = Kind(r.num());
+        e.name = r.str();
+        e.dll = r.str();
+        e.src = r.str();
+        e.label = r.num();
+        e.line = r.num();
+        e.column = r.num();
+        if (e.label >= labels.size()) r.ok = false;
+    }
+    imported.resize(r.count(12));
+    for (auto &imp: imported) {
+        imp.sym = r.str();
+        imp.dll = r.str();
+        imp.conv = Conv(r.num());
+        if (imp.conv > Fastcall) r.ok = false;
+    }
+    functions.resize(r.count(24));
+    for (auto &f: functions) {
+        f.name = r.str();
+        f.label = r.num();
+        f.conv = Conv(r.num());
+        f.nargs = r.num();
+        f.nregs = r.count(1);
+        auto n = r.count(16);
+        f.code.reserve(n);
+        for (size_t k = 0; k < n; ++k) {
+            auto op = Insn::Op(r.num());
+            Operand a;
+            a.kind = Operand::Kind(r.num());
+            a.value = r.num();
+            f.code.emplace_back(op, a, r.num());
+            auto &i = f.code.back();
+            if (op > Insn::Result || a.kind > Operand::Reg
+                    || (a.kind == Operand::Label && a.value >= labels.size())
+                    || (a.kind == Operand::Reg && DWORD(a.value) >= f.nregs)
+                    || (hasDest(op) && DWORD(i.n) >= f.nregs))
+                r.ok = false;
+        }
+        if (f.label >= labels.size() || f.conv > Fastcall) r.ok = false;
+    }
+    if (!r.ok || r.pos != in.size()) return false;
+    src = path;
+
+    // the lookups that func(), str() and iat() keep while parsing
+    for (auto &e: externs) {
+        switch (e.kind) {
+        case Func:
+            funcs.emplace(names.intern(e.name), e.label);
+            break;
+        case Str:
+            strs.emplace(names.intern(e.name), e.label);
+            break;
+        case Import:
+            iats.emplace(pairKey(names.intern(e.dll), names.intern(e.name)),
+                         e.label);
+            break;
+        }
+    }
+    return true;
+}
+
+void Module::optimize() {
+    for (auto &f: functions) ::optimize(f);
+}
+
+// encodes the functions into text; imported is every function declared by
+// import in some module and defined in none, which are called through
+// the IAT, and convs the functions that are not cdecl
+void Module::lower(const map<string, string> &imported,
+                   const map<string, Conv> &convs, Abi abi) {
+    select();
+    Imports imps(labels.size());
+    vector<Conv> conv(labels.size(), Cdecl);
+    for (auto &e: externs) {
+        if (e.kind != Func) continue;
+        auto it = imported.find(e.name);
+        if (it != imported.end()) imps[e.label] = &*it;
+        auto c = convs.find(e.name);
+        if (c != convs.end()) conv[e.label] = c->second;
+    }
+    for (auto &f: functions) {
+        text.put(Address::label(f.label));
+        if (abi == I386)
+            lower32(f, imps, conv);
+        else
+            lower64(f, imps, abi);
+    }
+}
+
+namespace {
+
+// an operand once registers are allocated
+struct Loc {
+    enum Kind { Imm, Reg, Mem, Addr };
+    Kind kind;
+    DWORD imm = 0;
+    reg32 r = eax;
+    Disp m = { ebp, 0 };
+    Address ad;
+};
+
+void fetch(reg32 r, const Loc &l, bool wide) {
+    switch (l.kind) {
+    case Loc::Imm: mov(r, l.imm); break;
+    case Loc::Reg: if (l.r != r) mov(r, l.r); break;
+    case Loc::Mem: mov(r, ptr[l.m]); break;
+    case Loc::Addr:
+        if (wide) lea(reg64(r), ptr[rip + l.ad]); else mov(r, l.ad);
+        break;
+    }
+}
+
+void store(const Loc &l, reg32 r) {
+    if (l.kind == Loc::Reg) {
+        if (l.r != r) mov(l.r, r);
+    } else
+        mov(ptr[l.m], r);
+}
+
+// r op= a for Add, Sub, Mul and the compares
+void alu(Insn::Op op, reg32 r, const Loc &a) {
+    switch (op) {
+    case Insn::Add:
+        if (a.kind == Loc::Imm) add(r, a.imm);
+        else if (a.kind == Loc::Reg) add(r, a.r);
+        else add(r, ptr[a.m]);
+        break;
+    case Insn::Sub:
+        if (a.kind == Loc::Imm) sub(r, a.imm);
+        else if (a.kind == Loc::Reg) sub(r, a.r);
+        else sub(r, ptr[a.m]);
+        break;
+    case Insn::Mul:
+        if (a.kind == Loc::Imm) imul(r, r, a.imm);
+        else if (a.kind == Loc::Reg) imul(r, a.r);
+        else imul(r, ptr[a.m]);
+        break;
+    default:
+        if (a.kind == Loc::Imm) cmp(r, a.imm);
+        else if (a.kind == Loc::Reg) cmp(r, a.r);
+        else cmp(r, ptr[a.m]);
+        break;
+    }
+}
+
+// the instructions on 32-bit integers, which both targets encode alike
+// with eax as scratch; loc places an operand
+template <typename F> void lowerInt(const Insn &i, F loc, bool wide) {
+    auto d = loc(Operand::reg(i.n));
+    // a register destination, or eax standing in for a spilled one
+    auto r = d.kind == Loc::Reg ? d.r : eax;
+    switch (i.op) {
+    case Insn::Mov: {
+        auto a = loc(i.a);
+        if (d.kind == Loc::Mem && a.kind == Loc::Imm)
+            mov(ptr[d.m], a.imm);
+        else if (d.kind == Loc::Reg || a.kind == Loc::Reg)
+            a.kind == Loc::Reg ? store(d, a.r) : fetch(d.r, a, wide);
+        else {
+            fetch(eax, a, wide);
+            store(d, eax);
+        }
+        break;
+    }
+    case Insn::Result:
+        store(d, eax);
+        break;
+    case Insn::Div: {
+        auto a = loc(i.a);
+        fetch(eax, d, wide);
+        cdq();
+        if (a.kind == Loc::Reg) idiv(a.r); else idiv(ptr[a.m]);
+        store(d, eax);
+        break;
+    }
+    case Insn::Add:
+    case Insn::Sub:
+    case Insn::Mul:
+        if (d.kind != Loc::Reg) fetch(eax, d, wide);
+        alu(i.op, r, loc(i.a));
+        if (d.kind != Loc::Reg) store(d, eax);
+        break;
+    default:
+        if (d.kind != Loc::Reg) fetch(eax, d, wide);
+        alu(i.op, r, loc(i.a));
+        switch (i.op) {
+        case Insn::SetEq: sete(al); break;
+        case Insn::SetNe: setne(al); break;
+        case Insn::SetLt: setl(al); break;
+        case Insn::SetLe: setle(al); break;
+        case Insn::SetGt: setg(al); break;
+        default: setge(al); break;
+        }
+        movzx(r, al);
+        if (d.kind != Loc::Reg) store(d, eax);
+        break;
+    }
+}
+
+// i386: ecx and edx go first to values that no call or division
+// clobbers; ebx, esi and edi are saved by the callee
+const reg32 pool32[] = { ecx, edx, ebx, esi, edi };
+const unsigned callee32 = 0x1c;
+
+// x86-64: r10 and r11 are volatile in both conventions and pass no
+// arguments; rdx, which idiv clobbers, is never allocated
+const reg32 sysvpool[] = { r10d, r11d, ebx, r12d, r13d, r14d, r15d };
+const reg32 win64pool[] = { r10d, r11d, ebx, esi, edi, r12d, r13d, r14d, r15d };
+
+}
+
+// fastcall parameters in ecx and edx are stored below the saved
+// registers on entry and read from there like the others; at a call,
+// the last pushes of a fastcall callee's arguments become the loads of
+// ecx and edx, and the add esp after it drops what the callee popped
+void Module::lower32(const Function &f, const Imports &imps,
+                     const vector<Conv> &convs) {
+    auto value = [&](const Operand &a) {
+        return Address::label(a.value);
+    };
+    auto alloc = allocate(f, 5, 0x3, 0x2);
+    vector<reg32> saved;
+    for (int k = 0; k < 5; ++k)
+        if ((alloc.used & callee32) >> k & 1) saved.push_back(pool32[k]);
+    int home = 4 * saved.size();
+    int nreg = regArgs(f.conv, f.nargs);
+    int base = home + 4 * nreg;
+    auto param = [&](int n) {
+        return n < nreg ? ebp - (home + 4 * (n + 1))
+                        : ebp + (8 + 4 * (n - nreg));
+    };
+    auto loc = [&](const Operand &a) {
+        Loc l;
+        switch (a.kind) {
+        case Operand::Imm:
+            l.kind = Loc::Imm;
+            l.imm = a.value;
+            break;
+        case Operand::Label:
+            l.kind = Loc::Addr;
+            l.ad = value(a);
+            break;
+        case Operand::Arg:
+            l.kind = Loc::Mem;
+            l.m = param(a.value);
+            break;
+        default:
+            if (alloc.loc[a.value] >= 0) {
+                l.kind = Loc::Reg;
+                l.r = pool32[alloc.loc[a.value]];
+            } else {
+                l.kind = Loc::Mem;
+                l.m = ebp - (base + 4 * (~alloc.loc[a.value] + 1));
+            }
+            break;
+        }
+        return l;
+    };
+    auto push32 = [&](const Operand &a) {
+        switch (a.kind) {
+        case Operand::Imm  : push(DWORD(a.value)); break;
+        case Operand::Label: push(value(a)); break;
+        case Operand::Arg  : push(ptr[param(a.value)]); break;
+        case Operand::Reg: {
+            auto l = loc(a);
+            if (l.kind == Loc::Reg) push(l.r); else push(ptr[l.m]);
+            break;
+        }
+        default: break;
+        }
+    };
+    // fastcall arguments 0 and 1 go to ecx and edx, which may hold
+    // either of them
+    auto load = [&](const vector<Operand> &args) {
+        if (args.size() < 2) {
+            fetch(ecx, loc(args[0]), false);
+            return;
+        }
+        auto a0 = loc(args[0]), a1 = loc(args[1]);
+        bool swap0 = a0.kind == Loc::Reg && a0.r == edx;
+        bool swap1 = a1.kind == Loc::Reg && a1.r == ecx;
+        if (swap0 && swap1) {
+            mov(eax, ecx);
+            mov(ecx, edx);
+            mov(edx, eax);
+        } else if (swap1) {
+            fetch(edx, a1, false);
+            fetch(ecx, a0, false);
+        } else {
+            fetch(ecx, a0, false);
+            fetch(edx, a1, false);
+        }
+    };
+
+    // pushes wait for their call, which decides where its arguments go;
+    // popped is what the last callee took off the stack
+    vector<Operand> pushed;
+    int popped = 0;
+    for (auto &i: f.code) {
+        if (i.op != Insn::Push && i.op != Insn::Call && i.op != Insn::Jmp) {
+            for (auto &a: pushed) push32(a);
+            pushed.clear();
+        }
+        switch (i.op) {
+        case Insn::Enter:
+            push(ebp);
+            mov(ebp, esp);
+            if (base + alloc.spills > 0)
+                sub(esp, DWORD(base + 4 * alloc.spills));
+            for (int k = 0; k < saved.size(); ++k)
+                mov(ptr[ebp - 4 * (k + 1)], saved[k]);
+            if (nreg > 0) mov(ptr[param(0)], ecx);
+            if (nreg > 1) mov(ptr[param(1)], edx);
+            break;
+        case Insn::Leave:
+            for (int k = 0; k < saved.size(); ++k)
+                mov(saved[k], ptr[ebp - 4 * (k + 1)]);
+            leave();
+            break;
+        case Insn::Ret:
+            if (calleePops(f.conv, f.nargs) > 0)
+                ret(WORD(calleePops(f.conv, f.nargs)));
+            else
+                ret();
+            break;
+        case Insn::Push:
+            pushed.push_back(i.a);
+            break;
+        case Insn::Call:
+        case Insn::Jmp: {
+            // the arguments are pushed last to first
+            auto conv = convs[i.a.value];
+            int n = regArgs(conv, i.n);
+            vector<Operand> args(pushed.rbegin(), pushed.rbegin() + n);
+            pushed.resize(pushed.size() - n);
+            for (auto &a: pushed) push32(a);
+            pushed.clear();
+            if (n > 0) load(args);
+            popped = conv != Cdecl ? 4 * i.n : 0;
+
+            auto imp = imps[i.a.value];
+            if (imp) {
+                auto ad = ptr[iat(imp->second, imp->first)];
+                if (i.op == Insn::Call) call(ad); else jmp(ad);
+            } else {
+                auto ad = value(i.a);
+                if (i.op == Insn::Call) call(ad); else jmp(ad);
+            }
+            break;
+        }
+        case Insn::AddEsp:
+            if (i.n > popped) add(esp, DWORD(i.n - popped));
+            popped = 0;
+            break;
+        case Insn::MovEax:
+            if (i.a.kind == Operand::Imm)
+                mov(eax, DWORD(i.a.value));
+            else if (i.a.kind == Operand::Label)
+                mov(eax, value(i.a));
+            else
+                fetch(eax, loc(i.a), false);
+            break;
+        default:
+            lowerInt(i, loc, false);
+            break;
+        }
+    }
+}
+
+// System V passes six arguments in registers; Windows passes four and
+// reserves 32 bytes above the return address where the callee may
+// store them
+static const reg64 sysvregs[] = { rdi, rsi, rdx, rcx, r8, r9 };
+static const reg64 win64regs[] = { rcx, rdx, r8, r9 };
+
+// the IR pushes arguments for the 32-bit stack convention; here the
+// pushes before a call are collected and passed in registers, and every
+// function with calls, parameters or saved registers gets a frame that
+// keeps rsp 16-byte aligned at its calls and holds the parameters, the
+// callee-saved registers it uses and its spilled values
+void Module::lower64(const Function &f, const Imports &imps, Abi abi) {
+    auto regs = abi == Win64 ? win64regs : sysvregs;
+    int nregs = abi == Win64 ? 4 : 6;
+    auto pool = abi == Win64 ? win64pool : sysvpool;
+    int npool = abi == Win64 ? 9 : 7;
+
+    auto alloc = allocate(f, npool, 0x3, 0);
+    vector<reg64> saved;
+    for (int k = 2; k < npool; ++k)
+        if (alloc.used >> k & 1) saved.push_back(reg64(pool[k]));
+
+    int maxargs = -1;
+    bool args = false;
+    for (auto &i: f.code) {
+        if (i.op == Insn::Call) maxargs = max(maxargs, i.n);
+        if (i.a.kind == Operand::Arg) args = true;
+    }
+    bool frame = maxargs >= 0 || args || !saved.empty() || alloc.spills > 0;
+    int spill = abi == SysV && args ? 8 * min(f.nargs, nregs) : 0;
+    int saves = spill + 8 * saved.size();
+    int locals = saves + 4 * alloc.spills;
+    int out = 0;
+    if (maxargs >= 0)
+        out = abi == Win64 ? 8 * max(maxargs, nregs) : 8 * max(maxargs - nregs, 0);
+    int size = ::align(locals + out, 16);
+
+    auto param = [&](int n) {
+        if (abi == Win64) return 16 + 8 * n;
+        if (n < nregs) return -8 * (n + 1);
+        return 16 + 8 * (n - nregs);
+    };
+    auto loc = [&](const Operand &a) {
+        Loc l;
+        switch (a.kind) {
+        case Operand::Imm:
+            l.kind = Loc::Imm;
+            l.imm = a.value;
+            break;
+        case Operand::Label:
+            l.kind = Loc::Addr;
+            l.ad = Address::label(a.value);
+            break;
+        case Operand::Arg:
+            l.kind = Loc::Mem;
+            l.m = ebp + param(a.value);
+            break;
+        default:
+            if (alloc.loc[a.value] >= 0) {
+                l.kind = Loc::Reg;
+                l.r = pool[alloc.loc[a.value]];
+            } else {
+                l.kind = Loc::Mem;
+                l.m = ebp - (saves + 4 * (~alloc.loc[a.value] + 1));
+            }
+            break;
+        }
+        return l;
+    };
+    // parameters are passed on as they came, 64 bits wide; values of
+    // registers are 32-bit and zero-extended
+    auto load = [&](reg64 r, const Operand &a) {
+        switch (a.kind) {
+        case Operand::Imm  : mov(r, DWORD(a.value)); break;
+        case Operand::Label: lea(r, ptr[rip + Address::label(a.value)]); break;
+        case Operand::Arg  : mov(r, ptr[rbp + param(a.value)]); break;
+        case Operand::Reg  : fetch(reg32(r), loc(a), true); break;
+        default: break;
+        }
+    };
+    auto epilogue = [&] {
+        if (!frame) return;
+        for (int k = 0; k < saved.size(); ++k)
+            mov(saved[k], ptr[rbp - (spill + 8 * (k + 1))]);
+        leave();
+    };
+
+    if (frame) {
+        push(rbp);
+        mov(rbp, rsp);
+        if (size > 0) sub(rsp, DWORD(size));
+        if (args)
+            for (int n = 0; n < min(f.nargs, nregs); ++n)
+                mov(ptr[rbp + param(n)], regs[n]);
+        for (int k = 0; k < saved.size(); ++k)
+            mov(ptr[rbp - (spill + 8 * (k + 1))], saved[k]);
+    }
+
+    vector<Operand> pushed;
+    for (auto &i: f.code) {
+        switch (i.op) {
+        case Insn::Enter:
+        case Insn::Leave:
+        case Insn::AddEsp:
+            break;
+        case Insn::Ret:
+            epilogue();
+            ret();
+            break;
+        case Insn::Push:
+            pushed.push_back(i.a);
+            break;
+        case Insn::Call:
+        case Insn::Jmp: {
+            // the last n pushes, the first argument pushed last; none of
+            // them lives in an argument register, so no register is
+            // overwritten before it is read
+            int n = min(i.n, int(pushed.size()));
+            auto arg = [&](int k) { return pushed[pushed.size() - 1 - k]; };
+            for (int k = nregs; k < n; ++k) {
+                load(rax, arg(k));
+                mov(ptr[rsp + 8 * (abi == Win64 ? k : k - nregs)], rax);
+            }
+            for (int k = 0; k < n && k < nregs; ++k)
+                load(regs[k], arg(k));
+            pushed.resize(pushed.size() - n);
+
+            if (i.op == Insn::Jmp) epilogue();
+            auto imp = imps[i.a.value];
+            if (imp) {
+                // al holds the number of vector registers for variadic
+                // C functions
+                if (abi == SysV) mov(eax, DWORD(0));
+                auto ad = ptr[rip + iat(imp->second, imp->first)];
+                if (i.op == Insn::Call) call(ad); else jmp(ad);
+            } else {
+                auto ad = Address::label(i.a.value);
+                if (i.op == Insn::Call) call(ad); else jmp(ad);
+            }
+            break;
+        }
+        case Insn::MovEax:
+            load(rax, i.a);
+            break;
+        default:
+            lowerInt(i, loc, true);
+            break;
+        }
+    }
+}
+
+namespace {
+
+struct Def {
+    Module *mod;
+    Function *f;
+    int state = 0; // 1: on the DFS stack, 2: done
+    bool recursive = false;
+};
+
+// functions of all modules by name; the last definition wins, as in link()
+class Graph {
+protected:
+    Interner names;
+    HashMap<int, Def> defs; // by interned name
+    vector<vector<int>> externs; // label -> index in Module::externs
+    vector<Module> &mods;
+
+public:
+    Graph(vector<Module> &mods): mods(mods) {
+        externs.resize(mods.size());
+        for (int i = 0; i < mods.size(); ++i) {
+            auto &mod = mods[i];
+            externs[i].resize(mod.labels.size(), -1);
+            for (int j = 0; j < mod.externs.size(); ++j)
+                externs[i][mod.externs[j].label] = j;
+            for (auto &f: mod.functions) defs[names.intern(f.name)] = { &mod, &f };
+        }
+    }
+
+protected:
+    const Module::Extern *target(const Module &mod, const Operand &a) {
+        if (a.kind != Operand::Label) return NULL;
+        auto &ext = externs[&mod - &mods[0]];
+        if (a.value >= ext.size() || ext[a.value] < 0) return NULL;
+        return &mod.externs[ext[a.value]];
+    }
+
+    Def *function(const Module &mod, const Operand &a) {
+        auto e = target(mod, a);
+        if (!e || e->kind != Module::Func) return NULL;
+        int id = names.find(e->name);
+        return id < 0 ? NULL : defs.find(id);
+    }
+};
+
+class Inliner: public Graph {
+private:
+    size_t threshold;
+
+public:
+    Inliner(vector<Module> &mods, size_t threshold):
+        Graph(mods), threshold(threshold) {}
+
+    void run() {
+        vector<Def *> stack;
+        for (auto &mod: mods)
+            for (auto &f: mod.functions) {
+                auto &d = *defs.find(names.find(f.name));
+                if (d.f == &f) visit(d, stack);
+            }
+    }
+
+private:
+    // a defined function is what its name calls even where an import
+    // declares the name too, as main() leaves such imports out of lowering
+    Def *callee(const Module &mod, const Insn &i) {
+        if (i.op != Insn::Call && i.op != Insn::Jmp) return NULL;
+        return function(mod, i.a);
+    }
+
+    // callees first, so that a function is inlined with its own calls
+    // already expanded
+    void visit(Def &d, vector<Def *> &stack) {
+        d.state = 1;
+        stack.push_back(&d);
+        for (auto &i: d.f->code) {
+            auto c = callee(*d.mod, i);
+            if (!c) continue;
+            if (c->state == 0)
+                visit(*c, stack);
+            else if (c->state == 1)
+                for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+                    (*it)->recursive = true;
+                    if (*it == c) break;
+                }
+        }
+        stack.pop_back();
+        expand(d);
+        d.state = 2;
+    }
+
+    // the code between the frame setup and the return, if it is straight
+    // and keeps no values of its own, whose registers would clash with
+    // the caller's
+    bool body(const Function &f, vector<Insn> &out) {
+        auto &code = f.code;
+        if (f.nregs > 0) return false;
+        size_t i = 0;
+        if (i < code.size() && code[i].op == Insn::Enter) ++i;
+        for (; i < code.size(); ++i) {
+            switch (code[i].op) {
+            case Insn::Ret:
+                if (!out.empty() && out.back().op == Insn::Leave)
+                    out.pop_back();
+                return out.size() <= threshold;
+            case Insn::Enter:
+            case Insn::Jmp:
+                return false;
+            default:
+                out.push_back(code[i]);
+                break;
+            }
+        }
+        return false;
+    }
+
+    void expand(Def &d) {
+        auto &mod = *d.mod;
+        auto &code = d.f->code;
+        mod.select();
+        vector<Insn> out, inl;
+        out.reserve(code.size());
+        for (size_t i = 0; i < code.size(); ++i) {
+            auto c = callee(mod, code[i]);
+            int n = code[i].n;
+            bool ok = c && c->state == 2 && !c->recursive
+                && code[i].op == Insn::Call && n <= out.size();
+            for (int j = 1; ok && j <= n; ++j)
+                ok = out[out.size() - j].op == Insn::Push;
+            if (ok && n > 0)
+                ok = i + 1 < code.size() && code[i + 1].op == Insn::AddEsp
+                    && code[i + 1].n == 4 * n;
+            inl.clear();
+            if (ok) ok = body(*c->f, inl);
+            for (auto &j: inl)
+                if (j.a.kind == Operand::Arg && j.a.value >= n) ok = false;
+            if (!ok) {
+                out.push_back(code[i]);
+                continue;
+            }
+            // arguments were pushed last to first
+            vector<Operand> args(n);
+            for (int j = 0; j < n; ++j)
+                args[j] = out[out.size() - 1 - j].a;
+            out.erase(out.end() - n, out.end());
+            for (auto j: inl) {
+                if (j.a.kind == Operand::Arg)
+                    j.a = args[j.a.value];
+                else if (auto e = target(*c->mod, j.a))
+                    j.a.value = translate(mod, *c->mod, *e);
+                out.push_back(j);
+            }
+            if (n > 0) ++i;
+            ++mod.inlined;
+        }
+        code.swap(out);
+    }
+
+    // label in mod for an extern of another module
+    int translate(Module &mod, const Module &from, const Module::Extern &e) {
+        if (&mod == &from) return e.label;
+        size_t n = mod.externs.size();
+        Address ad;
+        if (e.kind == Module::Str)
+            ad = mod.str(e.name);
+        else {
+            auto src = !e.src.empty() ? e.src : e.line > 0 ? from.src : "";
+            ad = mod.func(e.name, e.line, e.column, src);
+        }
+        if (mod.externs.size() > n) {
+            auto &ext = externs[&mod - &mods[0]];
+            ext.resize(mod.labels.size(), -1);
+            ext[ad.id] = n;
+        }
+        return ad.id;
+    }
+};
+
+class Collector: public Graph {
+public:
+    Collector(vector<Module> &mods): Graph(mods) {}
+
+    vector<pair<string, string>> run(const string &root) {
+        vector<Def *> work;
+        auto mark = [&](Def *d) {
+            if (d && !d->state) {
+                d->state = 2;
+                work.push_back(d);
+            }
+        };
+        int id = names.find(root);
+        if (id >= 0) mark(defs.find(id));
+        while (!work.empty()) {
+            auto d = work.back();
+            work.pop_back();
+            for (auto &i: d->f->code) mark(function(*d->mod, i.a));
+        }
+
+        vector<pair<string, string>> removed;
+        for (auto &mod: mods) {
+            auto &fs = mod.functions;
+            size_t n = 0;
+            for (size_t i = 0; i < fs.size(); ++i) {
+                auto &d = *defs.find(names.find(fs[i].name));
+                if (d.f == &fs[i] && d.state) {
+                    if (n != i) fs[n] = move(fs[i]);
+                    ++n;
+                } else
+                    removed.emplace_back(mod.src, fs[i].name);
+            }
+            fs.erase(fs.begin() + n, fs.end());
+        }
+        return removed;
+    }
+};
+
+}
+
+// replaces calls to small, non-recursive functions with their bodies
+void inlineCalls(vector<Module> &mods, size_t threshold) {
+    Inliner(mods, threshold).run();
+}
+
+// drops the functions that can not be reached from root, including
+// definitions overridden by a later one; returns (source, name) of each
+vector<pair<string, string>> removeUnreachable(vector<Module> &mods,
+                                               const string &root) {
+    return Collector(mods).run(root);
+}
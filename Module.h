@@ -0,0 +1,76 @@
+#pragma once
+
+#include "PELib.h"
+#include "Code.h"
+
+// front end output of one source file, built without touching the global PE
+struct Module {
+    enum Kind { Func, Str, Import };
+
+    // reference to a global symbol, in order of first use
+    struct Extern {
+        Kind kind;
+        std::string name, dll, src;
+        int label;
+        int line, column;
+    };
+
+    std::string src, error;
+    std::vector<Function> functions;
+    Buffer text;
+    std::vector<DWORD> labels;
+    std::vector<Extern> externs;
+
+    // functions declared by import, with their DLLs and conventions
+    struct Imported {
+        std::string sym, dll;
+        Conv conv;
+    };
+    std::vector<Imported> imported;
+
+    // for --stats
+    size_t tokens = 0, calls = 0, inlined = 0;
+    double lextime = 0, time = 0;
+
+    Module(const std::string &src);
+    void select();
+    Address func(const std::string &name, int line = 0, int column = 0,
+                 const std::string &src = "");
+    Address str(const std::string &s);
+    void import(const std::string &dll, const std::string &sym,
+                Conv conv = Cdecl);
+
+    void function(const std::string &name);
+    inline void emit(const Insn &i) { functions.back().code.push_back(i); }
+
+    // the front end's output as bytes, for the object cache and -c;
+    // load fails on data from another format version and restores src
+    // to the file the module was parsed from
+    void save(std::string &out) const;
+    bool load(const std::string &in);
+
+    void optimize();
+    void lower(const std::map<std::string, std::string> &imported,
+               const std::map<std::string, Conv> &convs, Abi abi = I386);
+
+private:
+    // per label: the import it names, or NULL
+    typedef std::vector<const std::pair<const std::string, std::string> *> Imports;
+
+    // labels of the externs by interned name, (dll, sym) for iats
+    Interner names;
+    HashMap<int, int> funcs, strs;
+    HashMap<uint64_t, int> iats;
+
+    Address external(Kind kind, const std::string &name,
+                     const std::string &dll, int line, int column,
+                     const std::string &src = "");
+    Address iat(const std::string &dll, const std::string &sym);
+    void lower32(const Function &f, const Imports &imps,
+                 const std::vector<Conv> &convs);
+    void lower64(const Function &f, const Imports &imps, Abi abi);
+};
+
+void inlineCalls(std::vector<Module> &mods, size_t threshold);
+std::vector<std::pair<std::string, std::string>>
+removeUnreachable(std::vector<Module> &mods, const std::string &root);
@@ -1,5 +1,9 @@
 #include "PELib.h"
+#include "Encoder.h"
+#include "Stats.h"
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 
@@ -9,16 +13,24 @@ DWORD align(DWORD size, DWORD aligned) {
     return (size + aligned - 1) / aligned * aligned;
 }
 
-Address::Address(): type(Abs) {}
-Address::Address(DWORD addr, AddrType type):
-    addr(shared_ptr<DWORD>(new DWORD(addr))), type(type) {}
-Address::Address(shared_ptr<DWORD> addr, AddrType type):
-    addr(addr), type(type) {}
-Address::Address(const Address &ad):
-    addr(ad.addr), type(ad.type) {}
+thread_local vector<DWORD> *curlabels;
+
+Address::Address(): id(-1), type(Abs) {}
+Address::Address(DWORD addr, AddrType type): type(type) {
+    id = curlabels->size();
+    curlabels->push_back(addr);
+}
+Address::Address(const Address &ad, AddrType type): id(ad.id), type(type) {}
+
+Address Address::label(int id, AddrType type) {
+    Address ret;
+    ret.id = id;
+    ret.type = type;
+    return ret;
+}
 
 bool operator!(const Address &ad) {
-    return !ad.addr.get();
+    return ad.id < 0;
 }
 
 Buffer::Buffer()
@@ -29,8 +41,21 @@ Buffer::Buffer()
 void Buffer::clear() {
     imgbase = start = 0;
     buffer.clear();
+    used = 0;
     values.clear();
     addrs .clear();
+    jumps .clear();
+}
+
+void Buffer::grow(size_t n) {
+    buffer.resize(max({ buffer.size() * 2, used + n, size_t(256) }));
+}
+
+// the room beyond used may hold leftovers of insn(), so new bytes are
+// cleared here
+void Buffer::resize(size_t size) {
+    if (size > used) memset(room(size - used), 0, size - used);
+    used = size;
 }
 
 void Buffer::align(size_t aligned) {
@@ -38,19 +63,39 @@ void Buffer::align(size_t aligned) {
 }
 
 Buffer &Buffer::operator << (const Buffer &buf) {
-    auto sz = buffer.size();
-    expand(buf.size());
-    memcpy(&buffer[sz], &buf.buffer[0], buf.size());
-    for (auto v: buf.values)
-        values.emplace_back(sz + v.first, v.second);
-    for (auto v: buf.addrs)
-        addrs.emplace_back(sz + v.first, v.second);
+    auto sz = size();
+    add(buf.buffer.data(), buf.size());
+    for (auto &v: buf.values)
+        values.push_back({ DWORD(sz + v.offset), v.label, v.type });
+    for (auto &a: buf.addrs)
+        addrs.push_back({ DWORD(sz + a.offset), a.id });
+    for (auto &j: buf.jumps)
+        jumps.push_back({ DWORD(sz + j.offset), j.op });
+    return *this;
+}
+
+// labels of buf are renumbered through map (label id in buf -> id here)
+Buffer &Buffer::append(const Buffer &buf, const vector<int> &map) {
+    auto sz = DWORD(size());
+    add(buf.buffer.data(), buf.size());
+    for (auto &v: buf.values)
+        values.push_back({ sz + v.offset, map[v.label], v.type });
+    for (auto &a: buf.addrs)
+        addrs.push_back({ sz + a.offset, map[a.id] });
+    for (auto &j: buf.jumps)
+        jumps.push_back({ sz + j.offset, j.op });
     return *this;
 }
 
+vector<bool> Buffer::referenced(size_t nlabels) const {
+    vector<bool> ret(nlabels);
+    for (auto &v: values) ret[v.label] = true;
+    return ret;
+}
+
 Buffer &Buffer::operator << (const Address &f) {
-    values.emplace_back(size(), f);
-    expand(4);
+    values.push_back({ DWORD(size()), f.id, f.type });
+    expand(f.type == Abs64 ? 8 : 4);
     return *this;
 }
 
@@ -62,26 +107,109 @@ Buffer &Buffer::operator << (const string &s) {
     return add(s.c_str(), s.size() + 1);
 }
 
+Buffer &Buffer::operator << (const IMAGE_DOS_HEADER &h) {
+    auto &b = *this;
+    b << u2(h.e_magic) << u2(h.e_cblp) << u2(h.e_cp) << u2(h.e_crlc)
+      << u2(h.e_cparhdr) << u2(h.e_minalloc) << u2(h.e_maxalloc)
+      << u2(h.e_ss) << u2(h.e_sp) << u2(h.e_csum) << u2(h.e_ip)
+      << u2(h.e_cs) << u2(h.e_lfarlc) << u2(h.e_ovno);
+    for (auto w: h.e_res) b << u2(w);
+    b << u2(h.e_oemid) << u2(h.e_oeminfo);
+    for (auto w: h.e_res2) b << u2(w);
+    return b << u4(h.e_lfanew);
+}
+
+Buffer &Buffer::operator << (const IMAGE_NT_HEADERS32 &h) {
+    auto &b = *this;
+    auto &fh = h.FileHeader;
+    b << u4(h.Signature)
+      << u2(fh.Machine) << u2(fh.NumberOfSections) << u4(fh.TimeDateStamp)
+      << u4(fh.PointerToSymbolTable) << u4(fh.NumberOfSymbols)
+      << u2(fh.SizeOfOptionalHeader) << u2(fh.Characteristics);
+    auto &oh = h.OptionalHeader;
+    b << u2(oh.Magic) << u1(oh.MajorLinkerVersion) << u1(oh.MinorLinkerVersion)
+      << u4(oh.SizeOfCode) << u4(oh.SizeOfInitializedData)
+      << u4(oh.SizeOfUninitializedData) << u4(oh.AddressOfEntryPoint)
+      << u4(oh.BaseOfCode) << u4(oh.BaseOfData) << u4(oh.ImageBase)
+      << u4(oh.SectionAlignment) << u4(oh.FileAlignment)
+      << u2(oh.MajorOperatingSystemVersion) << u2(oh.MinorOperatingSystemVersion)
+      << u2(oh.MajorImageVersion) << u2(oh.MinorImageVersion)
+      << u2(oh.MajorSubsystemVersion) << u2(oh.MinorSubsystemVersion)
+      << u4(oh.Win32VersionValue) << u4(oh.SizeOfImage)
+      << u4(oh.SizeOfHeaders) << u4(oh.CheckSum)
+      << u2(oh.Subsystem) << u2(oh.DllCharacteristics)
+      << u4(oh.SizeOfStackReserve) << u4(oh.SizeOfStackCommit)
+      << u4(oh.SizeOfHeapReserve) << u4(oh.SizeOfHeapCommit)
+      << u4(oh.LoaderFlags) << u4(oh.NumberOfRvaAndSizes);
+    for (auto &d: oh.DataDirectory)
+        b << u4(d.VirtualAddress) << u4(d.Size);
+    return b;
+}
+
+Buffer &Buffer::operator << (const IMAGE_NT_HEADERS64 &h) {
+    auto &b = *this;
+    auto &fh = h.FileHeader;
+    b << u4(h.Signature)
+      << u2(fh.Machine) << u2(fh.NumberOfSections) << u4(fh.TimeDateStamp)
+      << u4(fh.PointerToSymbolTable) << u4(fh.NumberOfSymbols)
+      << u2(fh.SizeOfOptionalHeader) << u2(fh.Characteristics);
+    auto &oh = h.OptionalHeader;
+    b << u2(oh.Magic) << u1(oh.MajorLinkerVersion) << u1(oh.MinorLinkerVersion)
+      << u4(oh.SizeOfCode) << u4(oh.SizeOfInitializedData)
+      << u4(oh.SizeOfUninitializedData) << u4(oh.AddressOfEntryPoint)
+      << u4(oh.BaseOfCode) << Wrap<uint64_t>(oh.ImageBase)
+      << u4(oh.SectionAlignment) << u4(oh.FileAlignment)
+      << u2(oh.MajorOperatingSystemVersion) << u2(oh.MinorOperatingSystemVersion)
+      << u2(oh.MajorImageVersion) << u2(oh.MinorImageVersion)
+      << u2(oh.MajorSubsystemVersion) << u2(oh.MinorSubsystemVersion)
+      << u4(oh.Win32VersionValue) << u4(oh.SizeOfImage)
+      << u4(oh.SizeOfHeaders) << u4(oh.CheckSum)
+      << u2(oh.Subsystem) << u2(oh.DllCharacteristics)
+      << Wrap<uint64_t>(oh.SizeOfStackReserve)
+      << Wrap<uint64_t>(oh.SizeOfStackCommit)
+      << Wrap<uint64_t>(oh.SizeOfHeapReserve)
+      << Wrap<uint64_t>(oh.SizeOfHeapCommit)
+      << u4(oh.LoaderFlags) << u4(oh.NumberOfRvaAndSizes);
+    for (auto &d: oh.DataDirectory)
+        b << u4(d.VirtualAddress) << u4(d.Size);
+    return b;
+}
+
+Buffer &Buffer::operator << (const IMAGE_SECTION_HEADER &h) {
+    add(h.Name, sizeof(h.Name));
+    return *this << u4(h.Misc.VirtualSize) << u4(h.VirtualAddress)
+        << u4(h.SizeOfRawData) << u4(h.PointerToRawData)
+        << u4(h.PointerToRelocations) << u4(h.PointerToLinenumbers)
+        << u2(h.NumberOfRelocations) << u2(h.NumberOfLinenumbers)
+        << u4(h.Characteristics);
+}
+
 Address Buffer::addr(AddrType type) {
     if (!addrs.empty()) {
-        auto p = addrs.back().second;
-        if (*p == size())
-            return Address(p, type);
+        auto id = addrs.back().id;
+        if ((*curlabels)[id] == size())
+            return Address::label(id, type);
     }
     Address ret(size(), type);
-    addrs.emplace_back(size(), ret.addr);
+    addrs.push_back({ DWORD(size()), ret.id });
     return ret;
 }
 
 void Buffer::put(const Address &addr) {
-    addrs.emplace_back(size(), addr.addr);
+    put(addr, size());
+}
+
+// labels go in offset order, so offset may not precede the last one
+void Buffer::put(const Address &addr, DWORD offset) {
+    addrs.push_back({ offset, addr.id });
 }
 
 void Buffer::reloc(DWORD imgbase, DWORD rva) {
     this->imgbase = imgbase;
     start = imgbase + rva;
-    for (auto ad: addrs)
-        *ad.second = start + ad.first;
+    auto &lb = *curlabels;
+    for (auto &a: addrs)
+        lb[a.id] = start + a.offset;
 }
 
 void Buffer::dump() {
@@ -99,27 +227,121 @@ void Buffer::dump() {
     }
 }
 
-void Buffer::write(FILE *f, size_t aligned) {
-    for (auto p: values) {
-        auto ad = *p.second.addr;
-        switch (p.second.type) {
+// the bytes at out, with the relocated value of every label reference
+// stored in place; the buffer itself stays as it is
+void Buffer::copy(BYTE *out) const {
+    if (size() > 0) memcpy(out, buffer.data(), size());
+    auto &lb = *curlabels;
+    for (auto &v: values) {
+        auto ad = lb[v.label];
+        switch (v.type) {
             case RVA:
                 ad -= imgbase;
                 break;
             case Rel:
-                ad -= start + p.first + 4;
+                ad -= start + v.offset + 4;
                 break;
         }
-        *reinterpret_cast<LPDWORD>(&buffer[p.first]) = ad;
+        auto p = out + v.offset;
+        p[0] = ad;
+        p[1] = ad >> 8;
+        p[2] = ad >> 16;
+        p[3] = ad >> 24;
+    }
+}
+
+// shortens the jumps whose target is a label of this buffer within rel8
+// range. Shortening only brings other targets closer, so passes repeat
+// until nothing changes; within a pass, distances measured before the
+// latest changes are upper bounds and therefore safe. values, addrs and
+// jumps are all in offset order, as they are appended.
+size_t Buffer::relax() {
+    if (jumps.empty()) return 0;
+    auto n = jumps.size();
+    auto oplen = [&](size_t j) { return jumps[j].op == 0xeb ? 1 : 2; };
+    auto saving = [&](size_t j) { return DWORD(oplen(j) + 4 - 2); };
+
+    vector<long> where(curlabels->size(), -1);
+    for (auto &a: addrs) where[a.id] = a.offset;
+    vector<long> target(n, -1);
+    vector<int> reloc(n, -1);
+    for (size_t j = 0; j < n; ++j) {
+        DWORD at = jumps[j].offset + oplen(j);
+        auto it = lower_bound(values.begin(), values.end(), at,
+            [](const Reloc &r, DWORD off) { return r.offset < off; });
+        if (it == values.end() || it->offset != at || it->type != Rel)
+            continue;
+        reloc[j] = it - values.begin();
+        target[j] = where[it->label];
+    }
+
+    // saved[k]: bytes removed by the short jumps among the first k
+    vector<bool> shrunk(n);
+    vector<DWORD> saved(n + 1);
+    auto update = [&] {
+        for (size_t j = 0; j < n; ++j)
+            saved[j + 1] = saved[j] + (shrunk[j] ? saving(j) : 0);
+    };
+    auto moved = [&](DWORD off) {
+        auto k = lower_bound(jumps.begin(), jumps.end(), off,
+            [](const Jump &j, DWORD o) { return j.offset < o; }) - jumps.begin();
+        return long(off) - long(saved[k]);
+    };
+    size_t count = 0;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        update();
+        for (size_t j = 0; j < n; ++j) {
+            if (shrunk[j] || target[j] < 0) continue;
+            long from = moved(jumps[j].offset) + 2;
+            long to = moved(target[j]);
+            if (target[j] > jumps[j].offset) to -= saving(j);
+            if (-128 <= to - from && to - from < 128) {
+                shrunk[j] = changed = true;
+                ++count;
+            }
+        }
     }
-    fwrite(&buffer[0], size(), 1, f);
-    if (aligned > 1) {
-        vector<BYTE> pad(::align(size(), aligned) - size());
-        fwrite(&pad[0], 1, pad.size(), f);
+    if (count == 0) return 0;
+    update();
+
+    vector<BYTE> out;
+    out.reserve(used - saved[n]);
+    vector<Reloc> vals;
+    vector<Jump> js;
+    DWORD cur = 0;
+    for (size_t j = 0; j < n; ++j) {
+        auto off = jumps[j].offset;
+        if (!shrunk[j]) {
+            js.push_back({ DWORD(moved(off)), jumps[j].op });
+            continue;
+        }
+        out.insert(out.end(), buffer.begin() + cur, buffer.begin() + off);
+        out.push_back(jumps[j].op);
+        out.push_back(BYTE(moved(target[j]) - (moved(off) + 2)));
+        cur = off + oplen(j) + 4;
     }
+    out.insert(out.end(), buffer.begin() + cur, buffer.begin() + used);
+
+    vector<bool> dropped(values.size());
+    for (size_t j = 0; j < n; ++j)
+        if (shrunk[j]) dropped[reloc[j]] = true;
+    for (size_t i = 0; i < values.size(); ++i)
+        if (!dropped[i]) {
+            auto v = values[i];
+            v.offset = moved(v.offset);
+            vals.push_back(v);
+        }
+    for (auto &a: addrs) a.offset = moved(a.offset);
+
+    buffer.swap(out);
+    used = buffer.size();
+    values.swap(vals);
+    jumps.swap(js);
+    return count;
 }
 
-Buffer *curtext;
+thread_local Buffer *curtext;
 
 Section::Section(const string &name, DWORD ch) : name(name) {
     memset(&h, 0, sizeof(h));
@@ -131,17 +353,170 @@ bool Section::bss() {
     return h.Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA;
 }
 
-PE::PE()
+void Image::clear() {
+    labels.clear();
+    curlabels = &labels;
+    sections.clear();
+    sects.clear();
+    names.clear();
+    syms.clear();
+    strs.clear();
+}
+
+// the literal pool: every literal is stored once, unpadded, and one that
+// ends another shares its bytes ("mundo" in "Ola mundo"). Sorted by
+// their reversed bytes, the literals that end a given one follow it
+// directly, so each is merged into its successor's storage if it is a
+// suffix of it; the rest are stored in order of first use
+void Image::literals() {
+    Phase phase("literals");
+    typedef HashMap<int, Address>::Entry Entry;
+    vector<const Entry *> order;
+    order.reserve(strs.size());
+    for (auto &e: strs) order.push_back(&e);
+    auto str = [&](const Entry *e) -> const string & { return names.str(e->first); };
+    sort(order.begin(), order.end(), [&](const Entry *a, const Entry *b) {
+        auto &x = str(a), &y = str(b);
+        return lexicographical_compare(x.rbegin(), x.rend(), y.rbegin(), y.rend());
+    });
+
+    // host: the literal whose storage holds one, by index in strs
+    size_t n = order.size();
+    vector<int> host(n);
+    vector<vector<int>> tails(n); // merged into it, longest first
+    auto index = [&](const Entry *e) { return int(e - &*strs.begin()); };
+    for (size_t i = n; i-- > 0;) {
+        auto &s = str(order[i]);
+        int self = index(order[i]);
+        if (i + 1 < n) {
+            auto &t = str(order[i + 1]);
+            if (s.size() < t.size()
+                    && t.compare(t.size() - s.size(), s.size(), s) == 0) {
+                host[self] = host[index(order[i + 1])];
+                tails[host[self]].push_back(self);
+                continue;
+            }
+        }
+        host[self] = self;
+    }
+
+    size_t merged = 0;
+    auto entries = &*strs.begin();
+    for (size_t i = 0; i < n; ++i) {
+        if (host[i] != int(i)) continue;
+        auto &s = names.str(entries[i].first);
+        DWORD offset = rdata->size();
+        rdata->put(entries[i].second);
+        for (int t: tails[i])
+            rdata->put(entries[t].second,
+                offset + s.size() - names.str(entries[t].first).size());
+        merged += tails[i].size();
+        *rdata << s;
+    }
+    if (stats.enabled()) {
+        stats.count("strings", n);
+        stats.count("strings.merged", merged);
+    }
+}
+
+// short jumps, before the sections are laid out
+void Image::relax() {
+    Phase phase("relax");
+    size_t count = 0;
+    for (auto &sect: sections) count += sect.relax();
+    if (stats.enabled()) stats.count("relaxed", count);
+}
+
+Section *Image::section(const string &name) {
+    for (int i = 0; i < sections.size(); i++) {
+        auto sec = &sections[i];
+        if (sec->name == name) return sec;
+    }
+    return NULL;
+}
+
+void Image::select() {
+    curtext = text;
+    curlabels = &labels;
+}
+
+Address Image::sym(int id, bool create) {
+    if (!create) {
+        auto ad = syms.find(id);
+        return ad ? *ad : Address();
+    }
+    auto r = syms.insert(id);
+    if (r.second) *r.first = Address(0);
+    return *r.first;
+}
+
+Address Image::sym(const string &s, bool create) {
+    int id = create ? names.intern(s) : names.find(s);
+    return id < 0 ? Address() : sym(id, create);
+}
+
+// a literal is placed by literals() at link time
+Address Image::str(const string &s) {
+    auto r = strs.insert(names.intern(s));
+    if (r.second) *r.first = Address(0);
+    return *r.first;
+}
+
+Address Image::ptr(const string &s, const Address &ptr) {
+    auto r = syms.insert(names.intern(s));
+    if (!r.second) return *r.first;
+
+    auto ret = *r.first = data->addr();
+    *data << ptr;
+    return ret;
+}
+
+Address Image::alloc(const string &s, size_t size) {
+    auto r = syms.insert(names.intern(s));
+    if (!r.second) return *r.first;
+
+    auto ret = *r.first = bss->addr();
+    bss->expand(::align(size, 4));
+    return ret;
+}
+
+Address Image::dword(const string &s, DWORD val) {
+    auto r = syms.insert(names.intern(s));
+    if (!r.second) return *r.first;
+
+    auto ret = *r.first = data->addr();
+    *data << u4(val);
+    return ret;
+}
+
+bool Image::write(FILE *f) {
+    vector<uint8_t> out;
+    writeToMemory(out);
+    return fwrite(out.data(), 1, out.size(), f) == out.size();
+}
+
+void Image::writeToMemory(vector<uint8_t> &out) {
+    if (sects.empty()) link();
+    Phase phase("write");
+    out.assign(filesize, 0);
+    render(out.data());
+}
+
+// lays the linked sections out again from a new base address
+void Image::relocate(DWORD base) {
+    for (auto sect: sects)
+        sect->reloc(base, sect->h.VirtualAddress);
+}
+
+PE::PE(Abi abi): Image(abi)
 {
     init();
 }
 
 void PE::init() {
-    sections.clear();
-    sects.clear();
+    clear();
     stub.clear();
     imports.clear();
-    syms.clear();
 
     sections.push_back(Section(".text",
         IMAGE_SCN_CNT_CODE | IMAGE_SCN_CNT_INITIALIZED_DATA |
@@ -166,7 +541,7 @@ void PE::init() {
     idata = section(".idata");
 
     memset(&dosh, 0, sizeof(dosh));
-    dosh.e_magic = *(LPWORD)"MZ";
+    dosh.e_magic = 'M' | 'Z' << 8;
     dosh.e_cblp = 0x90;
     dosh.e_cp = 3;
     dosh.e_cparhdr = 4;
@@ -185,15 +560,23 @@ void PE::init() {
     stub << "This program cannot be run in DOS mode.\r\r\n$";
 
     memset(&peh, 0, sizeof(peh));
-    peh.Signature = *(LPDWORD)"PE\0\0";
+    peh.Signature = 'P' | 'E' << 8;
 
     fh = &peh.FileHeader;
-    fh->Machine = 0x14c;
+    fh->Machine = IMAGE_FILE_MACHINE_I386;
     fh->SizeOfOptionalHeader = sizeof(*oph);
-    fh->Characteristics = 0x102;
+    fh->Characteristics =
+        IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_32BIT_MACHINE;
+    if (wide()) {
+        // PE32+, loaded at ImageBase since there is no .reloc
+        fh->Machine = IMAGE_FILE_MACHINE_AMD64;
+        fh->SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER64);
+        fh->Characteristics =
+            IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_RELOCS_STRIPPED;
+    }
 
     oph = &peh.OptionalHeader;
-    oph->Magic = 0x10b;
+    oph->Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
     oph->MajorLinkerVersion = 4;
     oph->AddressOfEntryPoint = 0x1000;
     oph->ImageBase = 0x400000;
@@ -209,17 +592,55 @@ void PE::init() {
     oph->SizeOfHeapReserve = 0x100000;
     oph->SizeOfHeapCommit = 0x1000;
     oph->NumberOfRvaAndSizes = 16;
-}
-
-Section *PE::section(const string &name) {
-    for (int i = 0; i < sections.size(); i++) {
-        auto sec = &sections[i];
-        if (sec->name == name) return sec;
+    if (wide()) {
+        oph->Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+        oph->MajorOperatingSystemVersion = 5;
+        oph->MinorOperatingSystemVersion = 2;
+        oph->MajorSubsystemVersion = 5;
+        oph->MinorSubsystemVersion = 2;
     }
-    return NULL;
 }
 
-void PE::select() { curtext = text; }
+// the PE32+ header carries the same values; only its layout differs
+static IMAGE_NT_HEADERS64 widen(const IMAGE_NT_HEADERS32 &h) {
+    IMAGE_NT_HEADERS64 w;
+    memset(&w, 0, sizeof(w));
+    w.Signature = h.Signature;
+    w.FileHeader = h.FileHeader;
+    auto &o = h.OptionalHeader;
+    auto &wo = w.OptionalHeader;
+    wo.Magic = o.Magic;
+    wo.MajorLinkerVersion = o.MajorLinkerVersion;
+    wo.MinorLinkerVersion = o.MinorLinkerVersion;
+    wo.SizeOfCode = o.SizeOfCode;
+    wo.SizeOfInitializedData = o.SizeOfInitializedData;
+    wo.SizeOfUninitializedData = o.SizeOfUninitializedData;
+    wo.AddressOfEntryPoint = o.AddressOfEntryPoint;
+    wo.BaseOfCode = o.BaseOfCode;
+    wo.ImageBase = o.ImageBase;
+    wo.SectionAlignment = o.SectionAlignment;
+    wo.FileAlignment = o.FileAlignment;
+    wo.MajorOperatingSystemVersion = o.MajorOperatingSystemVersion;
+    wo.MinorOperatingSystemVersion = o.MinorOperatingSystemVersion;
+    wo.MajorImageVersion = o.MajorImageVersion;
+    wo.MinorImageVersion = o.MinorImageVersion;
+    wo.MajorSubsystemVersion = o.MajorSubsystemVersion;
+    wo.MinorSubsystemVersion = o.MinorSubsystemVersion;
+    wo.Win32VersionValue = o.Win32VersionValue;
+    wo.SizeOfImage = o.SizeOfImage;
+    wo.SizeOfHeaders = o.SizeOfHeaders;
+    wo.CheckSum = o.CheckSum;
+    wo.Subsystem = o.Subsystem;
+    wo.DllCharacteristics = o.DllCharacteristics;
+    wo.SizeOfStackReserve = o.SizeOfStackReserve;
+    wo.SizeOfStackCommit = o.SizeOfStackCommit;
+    wo.SizeOfHeapReserve = o.SizeOfHeapReserve;
+    wo.SizeOfHeapCommit = o.SizeOfHeapCommit;
+    wo.LoaderFlags = o.LoaderFlags;
+    wo.NumberOfRvaAndSizes = o.NumberOfRvaAndSizes;
+    memcpy(wo.DataDirectory, o.DataDirectory, sizeof(wo.DataDirectory));
+    return w;
+}
 
 DWORD PE::align(DWORD size) {
     return ::align(size, oph->SectionAlignment);
@@ -229,60 +650,25 @@ DWORD PE::falign(DWORD size) {
     return ::align(size, oph->FileAlignment);
 }
 
-Address PE::sym(const string &s, bool create) {
-    auto it = syms.find(s);
-    if (it != syms.end()) return it->second;
-    if (!create) return Address();
-    Address ret(0);
-    syms[s] = ret;
-    return ret;
-}
-
-Address PE::str(const string &s) {
-    auto it = syms.find(s);
-    if (it != syms.end()) return it->second;
-
-    auto ret = rdata->addr();
-    syms[s] = ret;
-    *rdata << s;
-    rdata->align(4);
-    return ret;
-}
-
-Address PE::ptr(const string &s, const Address &ptr) {
-    auto it = syms.find(s);
-    if (it != syms.end()) return it->second;
-
-    auto ret = data->addr();
-    syms[s] = ret;
-    *data << ptr;
-    return ret;
-}
-
-Address PE::alloc(const string &s, size_t size) {
-    auto it = syms.find(s);
-    if (it != syms.end()) return it->second;
-
-    auto ret = bss->addr();
-    syms[s] = ret;
-    bss->expand(::align(size, 4));
-    return ret;
-}
-
-Address PE::dword(const string &s, DWORD val) {
-    auto it = syms.find(s);
-    if (it != syms.end()) return it->second;
-
-    auto ret = data->addr();
-    syms[s] = ret;
-    *data << &val;
-    return ret;
-}
-
 void PE::link() {
     sects.clear();
-    mkidata();
-    DWORD rva = oph->SectionAlignment;
+    literals();
+    {
+        Phase phase("mkidata");
+        mkidata();
+    }
+    relax();
+    Phase phase("link");
+    // the headers are mapped at RVA 0 and the bound import directory
+    // follows the section table; with enough bound DLLs they outgrow
+    // the first page, and the sections start after them
+    DWORD nsects = 0;
+    for (auto &sect: sections) nsects += sect.size() > 0;
+    DWORD headers = dosh.e_lfanew
+        + (wide() ? sizeof(IMAGE_NT_HEADERS64) : sizeof(peh))
+        + sizeof(IMAGE_SECTION_HEADER) * nsects;
+    oph->SizeOfHeaders = falign(headers + boundimports.size());
+    DWORD rva = align(oph->SizeOfHeaders);
     for (int i = 0; i < sections.size(); i++) {
         auto sect = &sections[i];
         auto size = sect->size();
@@ -299,133 +685,401 @@ void PE::link() {
     }
 
     fh->NumberOfSections = sects.size();
+    // _start begins the text
+    oph->AddressOfEntryPoint = text->h.VirtualAddress;
     oph->BaseOfCode = text->h.VirtualAddress;
     oph->SizeOfCode = falign(text->size());
     oph->BaseOfData = data->h.VirtualAddress;
     oph->SizeOfInitializedData = falign(data->size());
     oph->SizeOfUninitializedData = falign(bss->size());
     oph->SizeOfImage = rva;
-    oph->SizeOfHeaders = falign(
-        dosh.e_lfanew + sizeof(peh)
-        + sizeof(IMAGE_SECTION_HEADER) * sects.size());
-    oph->DataDirectory[1].VirtualAddress = idata->h.VirtualAddress;
-    oph->DataDirectory[1].Size = idata->size();
-}
-
-void PE::write(FILE *f) {
-    if (sects.empty()) link();
-
-    Buffer header;
-    header << &dosh << stub;
-    header.resize(dosh.e_lfanew);
-    header << &peh;
+    auto &imp = oph->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+    imp.VirtualAddress = idata->h.VirtualAddress;
+    imp.Size = idata->size();
+    // the file offset of the directory serves as its RVA too
+    auto &bound = oph->DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
+    bound.VirtualAddress = boundimports.size() ? headers : 0;
+    bound.Size = boundimports.size();
 
     DWORD ptr = oph->SizeOfHeaders;
     for (auto sect: sects) {
-        auto size = falign(sect->size());
         if (sect->bss()) {
             sect->h.SizeOfRawData = 0;
             sect->h.PointerToRawData = 0;
         } else {
-            sect->h.SizeOfRawData = size;
+            sect->h.SizeOfRawData = falign(sect->size());
             sect->h.PointerToRawData = ptr;
         }
-        header << &sect->h;
         ptr += sect->h.SizeOfRawData;
     }
+    filesize = ptr;
+
+    if (stats.enabled()) {
+        stats.count("imports", imports.size());
+        for (auto sect: sects) {
+            stats.count("relocations", sect->relocs());
+            stats.count("labels", sect->labels());
+        }
+    }
+}
+
+void PE::render(BYTE *out) {
+    Buffer header;
+    header << dosh << stub;
+    header.resize(dosh.e_lfanew);
+    if (wide())
+        header << widen(peh);
+    else
+        header << peh;
+    for (auto sect: sects) header << sect->h;
+    header << boundimports;
+    header.copy(out);
 
-    header.write(f, oph->FileAlignment);
+    if (stats.enabled()) stats.count("bytes.headers", oph->SizeOfHeaders);
     for (auto sect: sects)
-        if (!sect->bss())
-            sect->write(f, oph->FileAlignment);
+        if (!sect->bss()) {
+            sect->copy(out + sect->h.PointerToRawData);
+            if (stats.enabled())
+                stats.count("bytes" + sect->name, sect->h.SizeOfRawData);
+        }
 }
 
 Address PE::import(const string &dll, const string &sym) {
-    auto it = imports.find(dll);
-    if (it == imports.end()) {
-        Address ret(0);
-        imports[dll][sym] = ret;
-        return ret;
-    }
-    auto it2 = it->second.find(sym);
-    if (it2 == it->second.end()) {
-        Address ret(0);
-        it->second[sym] = ret;
-        return ret;
-    }
-    return it2->second;
+    auto r = imports.insert(pairKey(names.intern(dll), names.intern(sym)));
+    if (r.second) *r.first = Address(0);
+    return *r.first;
+}
+
+// by DLL and then symbol name, the order of the import directory
+vector<Import> PE::slots() const {
+    vector<Import> ret;
+    ret.reserve(imports.size());
+    for (auto &imp: imports)
+        ret.push_back({ names.str(imp.first >> 32),
+                        names.str(DWORD(imp.first)), imp.second });
+    sort(ret.begin(), ret.end(), [](const Import &a, const Import &b) {
+        int c = a.dll.compare(b.dll);
+        return c != 0 ? c < 0 : a.sym < b.sym;
+    });
+    return ret;
+}
+
+bool PE::exports(const string &dll, Exports &&table) {
+    if (table.machine != fh->Machine) return false;
+    dlls[dll] = move(table);
+    return true;
 }
 
 void PE::mkidata() {
     idata->clear();
+    boundimports.clear();
     if (imports.empty()) return;
 
+    // PE32+ thunks are 64 bits; the hint/name RVA fills the low half
     Buffer idt, ilt, iat, hn, name;
-    for (auto dll: imports) {
-        idt << ilt.rva() << u4(0) << u4(0) << name.rva() << iat.rva();
-        name << dll.first;
-        for (auto sym: dll.second) {
-            iat.put(sym.second);
-            ilt << hn.rva();
-            iat << hn.rva();
-            hn << u2(0) << sym.first;
+    auto thunk = [&](Buffer &b, const Address &ad) {
+        b << ad;
+        if (wide()) b << u4(0);
+    };
+    // bound DLLs: their time stamps and names, as the loader checks them
+    vector<pair<DWORD, string>> bound;
+    size_t hinted = 0;
+    auto imps = slots();
+    for (size_t i = 0; i < imps.size();) {
+        auto &dll = imps[i].dll;
+        size_t end = i;
+        while (end < imps.size() && imps[end].dll == dll) ++end;
+
+        // binding takes every import of the DLL, or none of them
+        auto it = dlls.find(dll);
+        auto table = it != dlls.end() ? &it->second : nullptr;
+        bool bind = binding && table;
+        for (size_t j = i; bind && j < end; ++j) {
+            auto e = table->names.find(imps[j].sym);
+            bind = e != table->names.end() && e->second.second != 0;
+        }
+        // -1: the binding is described by the bound import directory
+        DWORD stamp = bind ? 0xffffffff : 0;
+        idt << ilt.rva() << u4(stamp) << u4(stamp) << name.rva() << iat.rva();
+        if (bind) bound.emplace_back(table->timestamp, dll);
+        name << dll;
+        for (; i < end; ++i) {
+            // the loader tries the name at the hint before searching
+            DWORD hint = 0, rva = 0;
+            if (table) {
+                auto e = table->names.find(imps[i].sym);
+                if (e != table->names.end()) {
+                    if (e->second.first < 0x10000) {
+                        hint = e->second.first;
+                        ++hinted;
+                    }
+                    rva = e->second.second;
+                }
+            }
+            iat.put(imps[i].slot);
+            thunk(ilt, hn.rva());
+            if (bind) {
+                uint64_t va = table->imagebase + rva;
+                iat << u4(DWORD(va));
+                if (wide()) iat << u4(DWORD(va >> 32));
+            } else {
+                thunk(iat, hn.rva());
+            }
+            hn << u2(hint) << imps[i].sym;
             hn.align(2);
         }
-        ilt << u4(0);
-        iat << u4(0);
+        ilt.expand(wide() ? 8 : 4);
+        iat.expand(wide() ? 8 : 4);
     }
     idt.expand(sizeof(IMAGE_IMPORT_DESCRIPTOR));
     *idata << idt << ilt << iat << hn << name;
+    if (stats.enabled() && !dlls.empty()) {
+        stats.count("imports.hinted", hinted);
+        stats.count("dlls.bound", bound.size());
+    }
+
+    // names follow the descriptors and their terminator, at offsets
+    // from the start of the directory
+    if (bound.empty()) return;
+    size_t offset = (bound.size() + 1) * sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR);
+    for (auto &b: bound) {
+        boundimports << u4(b.first) << u2(WORD(offset)) << u2(0);
+        offset += b.second.size() + 1;
+    }
+    boundimports.expand(sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR));
+    for (auto &b: bound) boundimports << b.second;
 }
 
+// little-endian fields of a file in memory; a read out of bounds gives
+// 0 and clears ok, so that a damaged file is rejected once at the end
+namespace {
+struct FileReader {
+    const string &file;
+    bool ok = true;
+
+    uint64_t get(size_t off, int size) {
+        if (off > file.size() || file.size() - off < size_t(size)) {
+            ok = false;
+            return 0;
+        }
+        uint64_t v = 0;
+        for (int i = 0; i < size; ++i)
+            v |= uint64_t(BYTE(file[off + i])) << (8 * i);
+        return v;
+    }
+    inline WORD u2(size_t off) { return WORD(get(off, 2)); }
+    inline DWORD u4(size_t off) { return DWORD(get(off, 4)); }
+    inline uint64_t u8(size_t off) { return get(off, 8); }
+
+    string str(size_t off) {
+        if (off >= file.size()) {
+            ok = false;
+            return string();
+        }
+        auto end = file.find('\0', off);
+        if (end == string::npos) ok = false;
+        return file.substr(off, end - off);
+    }
+};
+}
+
+bool Exports::read(const string &file) {
+    FileReader f { file };
+    names.clear();
+    DWORD pe = f.u4(offsetof(IMAGE_DOS_HEADER, e_lfanew));
+    if (f.u2(0) != 0x5a4d || f.u4(pe) != 0x4550) return false;
+    size_t fh = pe + 4, oh = fh + sizeof(IMAGE_FILE_HEADER);
+    machine = f.u2(fh + offsetof(IMAGE_FILE_HEADER, Machine));
+    timestamp = f.u4(fh + offsetof(IMAGE_FILE_HEADER, TimeDateStamp));
+    WORD nsects = f.u2(fh + offsetof(IMAGE_FILE_HEADER, NumberOfSections));
+    size_t sects = oh + f.u2(fh + offsetof(IMAGE_FILE_HEADER, SizeOfOptionalHeader));
+    size_t dirs;
+    switch (f.u2(oh)) {
+    case IMAGE_NT_OPTIONAL_HDR32_MAGIC:
+        imagebase = f.u4(oh + offsetof(IMAGE_OPTIONAL_HEADER32, ImageBase));
+        dirs = oh + offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory);
+        break;
+    case IMAGE_NT_OPTIONAL_HDR64_MAGIC:
+        imagebase = f.u8(oh + offsetof(IMAGE_OPTIONAL_HEADER64, ImageBase));
+        dirs = oh + offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory);
+        break;
+    default:
+        return false;
+    }
+    // NumberOfRvaAndSizes comes right before the directories
+    if (f.u4(dirs - 4) <= IMAGE_DIRECTORY_ENTRY_EXPORT) return f.ok;
+    size_t dir = dirs + IMAGE_DIRECTORY_ENTRY_EXPORT * sizeof(IMAGE_DATA_DIRECTORY);
+    DWORD exp = f.u4(dir), expsize = f.u4(dir + 4);
+    if (!exp) return f.ok;
 
-void nop() { *curtext << 0x90; }
-void ret() { *curtext << 0xc3; }
-void leave() { *curtext << 0xc9; }
-void mov(reg32 r1, reg32 r2) { *curtext << 0x89 << 0xc0 + r1 + (r2 << 3); }
-void mov(reg32 r, DWORD v) { *curtext << 0xb8 + r << &v; }
-void mov(reg32 r, Address ad) { *curtext << 0xb8 + r << ad; }
+    // the file offset of an RVA, by the section that maps it
+    auto offset = [&](DWORD rva) -> size_t {
+        for (WORD i = 0; i < nsects; ++i) {
+            size_t h = sects + i * sizeof(IMAGE_SECTION_HEADER);
+            DWORD va = f.u4(h + offsetof(IMAGE_SECTION_HEADER, VirtualAddress));
+            DWORD size = f.u4(h + offsetof(IMAGE_SECTION_HEADER, SizeOfRawData));
+            if (va <= rva && rva - va < size)
+                return f.u4(h + offsetof(IMAGE_SECTION_HEADER, PointerToRawData)) + rva - va;
+        }
+        f.ok = false;
+        return 0;
+    };
+    size_t ed = offset(exp);
+    DWORD nfuncs = f.u4(ed + offsetof(IMAGE_EXPORT_DIRECTORY, NumberOfFunctions));
+    DWORD nnames = f.u4(ed + offsetof(IMAGE_EXPORT_DIRECTORY, NumberOfNames));
+    size_t funcs = offset(f.u4(ed + offsetof(IMAGE_EXPORT_DIRECTORY, AddressOfFunctions)));
+    size_t strs = offset(f.u4(ed + offsetof(IMAGE_EXPORT_DIRECTORY, AddressOfNames)));
+    size_t ords = offset(f.u4(ed + offsetof(IMAGE_EXPORT_DIRECTORY, AddressOfNameOrdinals)));
+    for (DWORD i = 0; f.ok && i < nnames; ++i) {
+        auto name = f.str(offset(f.u4(strs + 4 * i)));
+        WORD ord = f.u2(ords + 2 * i);
+        if (ord >= nfuncs) return false;
+        DWORD rva = f.u4(funcs + 4 * ord);
+        // a forwarder points into the export directory, at "dll.sym"
+        if (rva - exp < expsize) rva = 0;
+        names.emplace(name, make_pair(i, rva));
+    }
+    return f.ok;
+}
+
+
+// the emitters pick a form of Encoder.h by their operands (and the size
+// of an immediate) and pass the operands on by role
+using namespace x86;
+
+template <const Form &F> static inline void emit(int reg = 0, int rm = 0, DWORD imm = 0) {
+    Operands o;
+    o.reg = reg;
+    o.rm = rm;
+    o.imm = imm;
+    encode<F>(o);
+}
+
+template <const Form &F> static inline void emit(int reg, Disp m, DWORD imm = 0) {
+    Operands o;
+    o.reg = reg;
+    o.rm = m.base;
+    o.disp = m.disp;
+    o.imm = imm;
+    encode<F>(o);
+}
+
+template <const Form &F> static inline void emit(int reg, Disp64 m) {
+    Operands o;
+    o.reg = reg;
+    o.rm = m.base;
+    o.disp = m.disp;
+    encode<F>(o);
+}
+
+// an address operand: at for the ModRM forms, ad for the immediate ones;
+// r is the register operand, in whichever field the form puts it
+template <const Form &F> static inline void emit(int r, const Address &at, const Address &ad, DWORD imm = 0) {
+    Operands o;
+    o.reg = r;
+    o.rm = r;
+    o.imm = imm;
+    o.at = at;
+    o.ad = ad;
+    encode<F>(o);
+}
+
+void nop() { emit<NOP>(); }
+void ret() { emit<RET>(); }
+void ret(WORD n) { emit<RET_I16>(0, 0, n); }
+void leave() { emit<LEAVE>(); }
+// the register forms take r8d-r15d as well, for 32-bit values in x86-64
+// code; the prefix they need is only emitted for those
+template <int op> static void alu(reg32 r, DWORD v) {
+    if (imm8(v)) emit<ALU_RI8<op>>(0, r, v);
+    else emit<ALU_RI32<op>>(0, r, v);
+}
+
+void mov(reg32 r1, reg32 r2) { emit<MOV_RR>(r2, r1); }
+void mov(reg32 r, DWORD v) { emit<MOV_RI>(0, r, v); }
+void mov(reg32 r, Address ad) { emit<MOV_RA>(r, Address(), ad); }
 void mov(reg32 r, Ptr p) {
-    if (r == eax) *curtext << 0xa1 << p.val;
-    else *curtext << 0x8b << (r << 3) + 5 << p.val;
+    if (r == eax) emit<MOV_EAXP>(0, Address(), p.val);
+    else emit<MOV_RP>(r, p.val, Address());
 }
-void mov(Ptr p, DWORD v) { *curtext << 0xc7 << 0x05 << p.val << &v; }
-void mov(Ptr p, Address ad) { *curtext << 0xc7 << 0x05 << p.val << ad; }
+void mov(Ptr p, DWORD v) { emit<MOV_PI>(0, p.val, Address(), v); }
+void mov(Ptr p, Address ad) { emit<MOV_PA>(0, p.val, ad); }
 void mov(Ptr p, reg32 r) {
-    if (r == eax) *curtext << 0xa3 << p.val;
-    else *curtext << 0x89 << (r << 3) + 5 << p.val;
+    if (r == eax) emit<MOV_PEAX>(0, Address(), p.val);
+    else emit<MOV_PR>(r, p.val, Address());
 }
-void add(reg32 r1, reg32 r2) { *curtext << 0x01 << 0xc0 + r1 + (r2 << 3); }
+void mov(reg32 r, Mem m) { emit<MOV_RM>(r, m.val); }
+void mov(Mem m, reg32 r) { emit<MOV_MR>(r, m.val); }
+void mov(Mem m, DWORD v) { emit<MOV_MI>(0, m.val, v); }
+void add(reg32 r1, reg32 r2) { emit<ADD_RR>(r2, r1); }
+// unlike alu(), only small positive values take the short form
 void add(reg32 r, DWORD v) {
-    if (v < 128) *curtext << 0x83 << 0xc0 + r << v;
-    else *curtext << 0x81 << 0xc0 + r << &v;
-}
-void add(reg32 r, Address ad) { *curtext << 0x81 << 0xc0 + r << ad; }
-void push(reg32 r) { *curtext << 0x50 + r; }
-void push(DWORD v) { *curtext << 0x68 << &v; }
-void push(Address ad) { *curtext << 0x68 << ad; }
-void push(Ptr p) { *curtext << 0xff << 0x35 << p.val; }
-void push(Wrap<reg32> p) {
-    switch (p.val) {
-    case esp: *curtext << 0xff << 0x34 << 0x24; break;
-    case ebp: *curtext << 0xff << 0x75 << u1(0); break;
-    default : *curtext << 0xff << 0x30 + p.val; break;
-    }
+    if (v < 128) emit<ALU_RI8<0>>(0, r, v);
+    else emit<ALU_RI32<0>>(0, r, v);
 }
-void call(Ptr p) { *curtext << 0xff << 0x15 << p.val; }
-void call(Address ad) { *curtext << 0xe8 << Address(ad.addr, Rel); }
-void jmp (Ptr p) { *curtext << 0xff << 0x25 << p.val; }
-void jmp (Address ad) { *curtext << 0xe9 << Address(ad.addr, Rel); }
-void jc  (Address ad) { *curtext << 0x0f << 0x82 << Address(ad.addr, Rel); }
-void jnc (Address ad) { *curtext << 0x0f << 0x83 << Address(ad.addr, Rel); }
-void jz  (Address ad) { *curtext << 0x0f << 0x84 << Address(ad.addr, Rel); }
-void jnz (Address ad) { *curtext << 0x0f << 0x85 << Address(ad.addr, Rel); }
-void inc(reg32 r) { *curtext << 0x40 + r; }
+void add(reg32 r, Address ad) { emit<ADD_RA>(r, Address(), ad); }
+void add(reg32 r, Mem m) { emit<ADD_RM>(r, m.val); }
+void sub(reg32 r1, reg32 r2) { emit<SUB_RR>(r2, r1); }
+void sub(reg32 r, DWORD v) { alu<5>(r, v); }
+void sub(reg32 r, Mem m) { emit<SUB_RM>(r, m.val); }
+void imul(reg32 r1, reg32 r2) { emit<IMUL_RR>(r1, r2); }
+void imul(reg32 r, Mem m) { emit<IMUL_RM>(r, m.val); }
+void imul(reg32 r1, reg32 r2, DWORD v) {
+    if (imm8(v)) emit<IMUL_RRI8>(r1, r2, v);
+    else emit<IMUL_RRI32>(r1, r2, v);
+}
+void cdq() { emit<CDQ>(); }
+void idiv(reg32 r) { emit<IDIV_R>(0, r); }
+void idiv(Mem m) { emit<IDIV_M>(0, m.val); }
+void cmp(reg32 r1, reg32 r2) { emit<CMP_RR>(r2, r1); }
+void cmp(reg32 r, Mem m) { emit<CMP_RM>(r, m.val); }
+void sete (reg8 r) { emit<SETCC<0x4>>(0, r); }
+void setne(reg8 r) { emit<SETCC<0x5>>(0, r); }
+void setl (reg8 r) { emit<SETCC<0xc>>(0, r); }
+void setle(reg8 r) { emit<SETCC<0xe>>(0, r); }
+void setg (reg8 r) { emit<SETCC<0xf>>(0, r); }
+void setge(reg8 r) { emit<SETCC<0xd>>(0, r); }
+void movzx(reg32 r1, reg8 r2) { emit<MOVZX_RR>(r1, r2); }
+void push(reg32 r) { emit<PUSH_R>(0, r); }
+void push(DWORD v) { emit<PUSH_I>(0, 0, v); }
+void push(Address ad) { emit<PUSH_A>(0, Address(), ad); }
+void push(Ptr p) { emit<PUSH_P>(0, p.val, Address()); }
+void push(Wrap<reg32> p) { push(ptr[p.val + 0]); }
+void push(Mem m) { emit<PUSH_M>(0, m.val); }
+void call(Ptr p) { emit<CALL_P>(0, p.val, Address()); }
+void call(Address ad) { emit<CALL_A>(0, Address(), ad); }
+void jmp (Ptr p) { emit<JMP_P>(0, p.val, Address()); }
+// rel32 here; Image::link shortens them where the target is close
+void jmp (Address ad) { curtext->jump(0xeb); emit<JMP_A>(0, Address(), ad); }
+void jc  (Address ad) { curtext->jump(0x72); emit<JCC_A<0x2>>(0, Address(), ad); }
+void jnc (Address ad) { curtext->jump(0x73); emit<JCC_A<0x3>>(0, Address(), ad); }
+void jz  (Address ad) { curtext->jump(0x74); emit<JCC_A<0x4>>(0, Address(), ad); }
+void jnz (Address ad) { curtext->jump(0x75); emit<JCC_A<0x5>>(0, Address(), ad); }
+void inc(reg32 r) { emit<INC_R>(0, r); }
 void cmp(reg32 r, DWORD v) {
-    if (v < 128)
-        *curtext << 0x83 << 0xf8 + r << v;
-    else {
-        if (r == eax) *curtext << 0x3d << &v;
-        else *curtext << 0x81 << 0xf8 + r << &v;
-    }
+    if (r == eax && !imm8(v))
+        emit<CMP_EAXI>(0, 0, v);
+    else
+        alu<7>(r, v);
 }
+
+template <int op> static void alu(reg64 r, DWORD v) {
+    if (imm8(v)) emit<ALU_RI8_64<op>>(0, r, v);
+    else emit<ALU_RI32_64<op>>(0, r, v);
+}
+
+void push(reg64 r) { emit<PUSH_R64>(0, r); }
+void pop(reg64 r) { emit<POP_R64>(0, r); }
+void mov(reg64 r1, reg64 r2) { emit<MOV_RR64>(r2, r1); }
+// a 32-bit mov, which clears the upper half
+void mov(reg64 r, DWORD v) { emit<MOV_RI>(0, r, v); }
+void mov(reg64 r, Mem64 m) { emit<MOV_RM64>(r, m.val); }
+void mov(Mem64 m, reg64 r) { emit<MOV_MR64>(r, m.val); }
+// the displacement is relative to the end of the instruction, which is
+// where the Rel relocation measures from as long as nothing follows it
+void lea(reg64 r, RipMem m) { emit<LEA_RRIP>(r, m.val.ad, Address()); }
+void add(reg64 r, DWORD v) { alu<0>(r, v); }
+void sub(reg64 r, DWORD v) { alu<5>(r, v); }
+void and_(reg64 r, DWORD v) { alu<4>(r, v); }
+void call(RipMem m) { emit<CALL_RIP>(0, m.val.ad, Address()); }
+void jmp (RipMem m) { emit<JMP_RIP>(0, m.val.ad, Address()); }
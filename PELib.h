@@ -4,22 +4,46 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <memory>
-#include <windows.h>
+#include <cstring>
+#include "PEFormat.h"
+#include "Symtab.h"
 
 DWORD align(DWORD size, DWORD aligned);
 
-enum AddrType { Abs, RVA, Rel};
+// label values live in an arena owned by PE; an Address is an index into it
+extern thread_local std::vector<DWORD> *curlabels;
+
+// Abs64 is a pointer slot of x86-64 code; labels stay below 4 GB, so
+// it holds the same value as Abs zero-extended to 8 bytes
+enum AddrType { Abs, RVA, Rel, Abs64 };
 struct Address {
-    std::shared_ptr<DWORD> addr;
+    int id;
     AddrType type;
     Address();
     Address(DWORD addr, AddrType type = Abs);
-    Address(std::shared_ptr<DWORD> addr, AddrType type);
-    Address(const Address &ad);
+    Address(const Address &ad, AddrType type);
+    static Address label(int id, AddrType type = Abs);
+    inline DWORD &operator *() const { return (*curlabels)[id]; }
 };
 bool operator!(const Address &ad);
 
+struct Reloc {
+    DWORD offset;
+    int label;
+    AddrType type;
+};
+
+struct Label {
+    DWORD offset;
+    int id;
+};
+
+// rel32 jump that Buffer::relax may turn into its rel8 form
+struct Jump {
+    DWORD offset; // of the opcode
+    BYTE op;      // rel8 opcode: eb for jmp, 7x for jcc
+};
+
 template <typename T> struct Wrap {
     T val;
     Wrap(T val): val(val) {}
@@ -32,55 +56,82 @@ typedef Wrap<Address> Ptr;
 class Buffer {
 private:
     DWORD imgbase, start;
+    // the content is buffer[0, used); the rest is room to write into, so
+    // that appending checks the size once and never zero-fills
     std::vector<BYTE> buffer;
-    std::vector<std::pair<DWORD, Address>> values;
-    std::vector<std::pair<DWORD, std::shared_ptr<DWORD>>> addrs;
+    size_t used;
+    std::vector<Reloc> values;
+    std::vector<Label> addrs;
+    std::vector<Jump> jumps;
+
+    void grow(size_t n);
 
 public:
     Buffer();
 
-    inline size_t size() const { return buffer.size(); }
-    inline void resize(size_t size) { buffer.resize(size, 0); }
-    inline void expand(size_t size) { resize(buffer.size() + size); }
+    inline size_t size() const { return used; }
+    inline size_t relocs() const { return values.size(); }
+    inline size_t labels() const { return addrs.size(); }
+    std::vector<bool> referenced(size_t nlabels) const;
+    void resize(size_t size);
+    inline void expand(size_t size) { resize(used + size); }
+    // n bytes to write at the end, which commit() then appends
+    inline BYTE *room(size_t n) {
+        if (buffer.size() - used < n) grow(n);
+        return &buffer[used];
+    }
+    inline void commit(size_t n) { used += n; }
 
     void clear();
     void align(size_t aligned);
 
     inline Buffer &add(const void *src, int size) {
-        auto sz = buffer.size();
-        expand(size);
-        memcpy(&buffer[sz], src, size);
+        if (size <= 0) return *this;
+        memcpy(room(size), src, size);
+        used += size;
         return *this;
     }
 
     inline Buffer &operator << (BYTE b1) {
-        buffer.push_back(b1);
+        *room(1) = b1;
+        ++used;
         return *this;
     }
 
     Buffer &operator << (const Buffer &buf);
+    Buffer &append(const Buffer &buf, const std::vector<int> &map);
     Buffer &operator << (const Address &f);
     Buffer &operator << (const char *s);
     Buffer &operator << (const std::string &s);
 
-    template <typename T> Buffer &operator << (const std::vector<T> &vec) {
-        return add(&vec[0], sizeof(T) * vec.size());
-    }
-
-    template <typename T> Buffer &operator << (T *src) {
-        return add(src, sizeof(T));
-    }
-
+    // integers are always stored little-endian
     template <typename T> Buffer &operator << (const Wrap<T> &v) {
-        return add(&v.val, sizeof(v.val));
+        auto p = room(sizeof(T));
+        for (size_t i = 0; i < sizeof(T); ++i)
+            p[i] = BYTE(v.val >> (8 * i));
+        used += sizeof(T);
+        return *this;
     }
 
+    Buffer &operator << (const IMAGE_DOS_HEADER &h);
+    Buffer &operator << (const IMAGE_NT_HEADERS32 &h);
+    Buffer &operator << (const IMAGE_NT_HEADERS64 &h);
+    Buffer &operator << (const IMAGE_SECTION_HEADER &h);
+
     Address addr(AddrType type = Abs);
     inline Address rva() { return addr(RVA); }
     void put(const Address &addr);
+    void put(const Address &addr, DWORD offset);
+    // an Address field of an instruction encoded in place, in offset order
+    inline void field(DWORD offset, const Address &ad) {
+        values.push_back({ offset, ad.id, ad.type });
+    }
     void reloc(DWORD imgbase, DWORD rva);
+    void copy(BYTE *out) const;
+    inline void jump(BYTE op) { jumps.push_back({ DWORD(size()), op }); }
+    size_t relax();
+    inline const BYTE *data() const { return buffer.data(); }
     void dump();
-    void write(std::FILE *f, size_t aligned = 1);
 };
 
 class Section: public Buffer {
@@ -92,48 +143,154 @@ public:
     bool bss();
 };
 
-extern Buffer *curtext;
+extern thread_local Buffer *curtext;
 
-class PE {
-private:
-    IMAGE_DOS_HEADER dosh;
-    Buffer stub;
-    IMAGE_NT_HEADERS32 peh;
-    IMAGE_FILE_HEADER *fh;
-    IMAGE_OPTIONAL_HEADER32 *oph;
+// code generation for the target: i386 with the conventions of Code.h,
+// or x86-64 with arguments in registers as the System V (Linux) or the
+// Windows convention does
+enum Abi { I386, SysV, Win64 };
+
+// an import as bound by the image: the slot holds the function address
+struct Import {
+    std::string dll, sym;
+    Address slot;
+};
+
+// an executable being linked: its sections, named data and the label
+// arena; the file formats differ in how imports are bound and written
+class Image {
+protected:
+    Abi target;
+    std::vector<DWORD> labels;
     std::vector<Section> sections;
     std::vector<Section *> sects;
-    Section *text, *data, *bss, *rdata, *idata;
-    std::map<std::string, std::map<std::string, Address>> imports;
-    std::map<std::string, Address> syms;
+    Section *text, *data, *bss, *rdata;
+    DWORD filesize = 0; // laid out by link()
+    // named data and string literals apart, so that a literal never
+    // resolves to a function of the same name; literals get their
+    // storage at link time
+    Interner names;
+    HashMap<int, Address> syms, strs;
 
 public:
-    PE();
-    void init();
+    Image(Abi target): target(target) {}
+    virtual ~Image() {}
+    inline Abi abi() const { return target; }
+    inline bool wide() const { return target != I386; }
     Section *section(const std::string &name);
     void select();
-    DWORD align(DWORD size);
-    DWORD falign(DWORD size);
+    inline int intern(std::string_view s) { return names.intern(s); }
+    inline const std::string &name(int id) const { return names.str(id); }
+    Address sym(int id, bool create = false);
     Address sym(const std::string &s, bool create = false);
     Address str(const std::string &s);
     Address ptr(const std::string &s, const Address &ptr);
     Address alloc(const std::string &s, size_t size);
     Address dword(const std::string &s, DWORD val);
-    void link();
-    void write(std::FILE *f);
-    Address import(const std::string &dll, const std::string &sym);
+
+    // the address of a slot holding the address of sym, for call [slot];
+    // NULL address if the format can not provide sym
+    virtual Address import(const std::string &dll, const std::string &sym) = 0;
+    virtual void link() = 0;
+    virtual std::vector<Import> slots() const = 0;
+    // the whole file with a single fwrite; false if that fails
+    bool write(std::FILE *f);
+    // the same bytes into out, for embedders that want no file at all
+    void writeToMemory(std::vector<uint8_t> &out);
+
+    // sections with content, at h.VirtualAddress, after link()
+    inline const std::vector<Section *> &linked() const { return sects; }
+    void relocate(DWORD base);
+
+protected:
+    void clear();
+    void literals();
+    void relax();
+    // stores the file into out, filesize bytes of zeros, so that padding
+    // costs nothing and every section is copied and patched once
+    virtual void render(BYTE *out) = 0;
+};
+
+// the export table of a DLL file, so that imports from it can carry
+// the right hints and be bound before the program runs
+struct Exports {
+    WORD machine = 0;
+    DWORD timestamp = 0;
+    uint64_t imagebase = 0;
+    // by name: the index in the name table, which is the hint, and the
+    // RVA of the function, 0 for a forwarder to another DLL
+    std::map<std::string, std::pair<DWORD, DWORD>> names;
+
+    // false if file is not a PE image or its tables are out of bounds
+    bool read(const std::string &file);
+};
+
+class PE: public Image {
+private:
+    IMAGE_DOS_HEADER dosh;
+    Buffer stub;
+    IMAGE_NT_HEADERS32 peh;
+    IMAGE_FILE_HEADER *fh;
+    IMAGE_OPTIONAL_HEADER32 *oph;
+    Section *idata;
+    HashMap<uint64_t, Address> imports; // by pairKey(dll, sym)
+    std::map<std::string, Exports> dlls;
+    bool binding = false;
+    Buffer boundimports; // in the headers, after the section table
+
+public:
+    PE(Abi abi = I386);
+    void init();
+    DWORD align(DWORD size);
+    DWORD falign(DWORD size);
+    void link() override;
+    Address import(const std::string &dll, const std::string &sym) override;
+    std::vector<Import> slots() const override;
+    // hints imports from dll by its table; false if the table is not
+    // for this machine
+    bool exports(const std::string &dll, Exports &&table);
+    // prebinds the imports from DLLs whose tables provide all of them
+    inline void bind(bool on) { binding = on; }
 
 private:
     void mkidata();
+    void render(BYTE *out) override;
 };
 
 
 enum reg64 { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
              r8 , r9 , r10, r11, r12, r13, r14, r15 };
-enum reg32 { eax, ecx, edx, ebx, esp, ebp, esi, edi };
+enum reg32 { eax, ecx, edx, ebx, esp, ebp, esi, edi,
+             r8d, r9d, r10d, r11d, r12d, r13d, r14d, r15d };
 enum reg16 {  ax,  cx,  dx,  bx,  sp,  bp,  si,  di };
 enum reg8  {  al,  cl,  dl,  bl,  ah,  ch,  dh,  bh };
 
+// base + displacement memory operand: ptr[ebp + 8]
+struct Disp {
+    reg32 base;
+    int disp;
+};
+inline Disp operator+(reg32 r, int disp) { return { r, disp }; }
+inline Disp operator-(reg32 r, int disp) { return { r, -disp }; }
+typedef Wrap<Disp> Mem;
+
+// the same for x86-64: ptr[rbp - 8]
+struct Disp64 {
+    reg64 base;
+    int disp;
+};
+inline Disp64 operator+(reg64 r, int disp) { return { r, disp }; }
+inline Disp64 operator-(reg64 r, int disp) { return { r, -disp }; }
+typedef Wrap<Disp64> Mem64;
+
+// RIP-relative operand of x86-64: ptr[rip + ad]
+enum regip { rip };
+struct RipDisp {
+    Address ad;
+};
+inline RipDisp operator+(regip, const Address &ad) { return { ad }; }
+typedef Wrap<RipDisp> RipMem;
+
 struct {
     template <typename T> Wrap<T> operator[](T t) {
         return Wrap<T>(t);
@@ -142,6 +299,7 @@ struct {
 
 void nop();
 void ret();
+void ret(WORD n); // and pop n bytes of arguments
 void leave();
 void mov(reg32 r1, reg32 r2);
 void mov(reg32 r, DWORD v);
@@ -150,14 +308,28 @@ void mov(reg32 r, Ptr p);
 void mov(Ptr p, DWORD v);
 void mov(Ptr p, Address ad);
 void mov(Ptr p, reg32 r);
+void mov(reg32 r, Mem m);
+void mov(Mem m, reg32 r);
+void mov(Mem m, DWORD v);
 void add(reg32 r1, reg32 r2);
 void add(reg32 r, DWORD v);
 void add(reg32 r, Address ad);
+void add(reg32 r, Mem m);
+void sub(reg32 r1, reg32 r2);
+void sub(reg32 r, DWORD v);
+void sub(reg32 r, Mem m);
+void imul(reg32 r1, reg32 r2);
+void imul(reg32 r, Mem m);
+void imul(reg32 r1, reg32 r2, DWORD v);
+void cdq();
+void idiv(reg32 r);
+void idiv(Mem m);
 void push(reg32 r);
 void push(DWORD v);
 void push(Address ad);
 void push(Ptr p);
 void push(Wrap<reg32> p);
+void push(Mem m);
 void call(Ptr p);
 void call(Address ad);
 void jmp (Ptr p);
@@ -168,3 +340,27 @@ void jz  (Address ad);
 void jnz (Address ad);
 void inc(reg32 r);
 void cmp(reg32 r, DWORD v);
+void cmp(reg32 r1, reg32 r2);
+void cmp(reg32 r, Mem m);
+void sete (reg8 r);
+void setne(reg8 r);
+void setl (reg8 r);
+void setle(reg8 r);
+void setg (reg8 r);
+void setge(reg8 r);
+void movzx(reg32 r1, reg8 r2);
+
+// x86-64, with a REX prefix where the operands need one; the 32-bit
+// forms above (ret, leave, call/jmp rel32, mov r32) encode the same
+void push(reg64 r);
+void pop(reg64 r);
+void mov(reg64 r1, reg64 r2);
+void mov(reg64 r, DWORD v);
+void mov(reg64 r, Mem64 m);
+void mov(Mem64 m, reg64 r);
+void lea(reg64 r, RipMem m);
+void add(reg64 r, DWORD v);
+void sub(reg64 r, DWORD v);
+void and_(reg64 r, DWORD v);
+void call(RipMem m);
+void jmp (RipMem m);
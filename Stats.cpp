@@ -0,0 +1,45 @@
+#include "Stats.h"
+
+using namespace std;
+
+Stats stats;
+
+void Stats::time(const string &phase, double sec) {
+    for (auto &p: phases)
+        if (p.first == phase) {
+            p.second += sec;
+            return;
+        }
+    phases.emplace_back(phase, sec);
+}
+
+void Stats::count(const string &name, size_t n) {
+    for (auto &c: counters)
+        if (c.first == name) {
+            c.second += n;
+            return;
+        }
+    counters.emplace_back(name, n);
+}
+
+void Stats::print(FILE *f) const {
+    if (format == Json) {
+        // milliseconds, as in the text form
+        fprintf(f, "{\"phases_ms\":{");
+        for (int i = 0; i < phases.size(); ++i)
+            fprintf(f, "%s\"%s\":%.3f", i ? "," : "",
+                phases[i].first.c_str(), phases[i].second * 1000);
+        fprintf(f, "},\"counters\":{");
+        for (int i = 0; i < counters.size(); ++i)
+            fprintf(f, "%s\"%s\":%zu", i ? "," : "",
+                counters[i].first.c_str(), counters[i].second);
+        fprintf(f, "}}\n");
+    } else if (format == Text) {
+        fprintf(f, "%-24s %12s\n", "phase", "ms");
+        for (auto &p: phases)
+            fprintf(f, "  %-22s %12.3f\n", p.first.c_str(), p.second * 1000);
+        fprintf(f, "%-24s %12s\n", "counter", "");
+        for (auto &c: counters)
+            fprintf(f, "  %-22s %12zu\n", c.first.c_str(), c.second);
+    }
+}
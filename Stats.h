@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// phase timings and counters reported by --stats
+class Stats {
+public:
+    enum Format { Off, Text, Json };
+    Format format = Off;
+
+    inline bool enabled() const { return format != Off; }
+    void time(const std::string &phase, double sec);
+    void count(const std::string &name, size_t n);
+    void print(std::FILE *f) const;
+
+private:
+    std::vector<std::pair<std::string, double>> phases;
+    std::vector<std::pair<std::string, size_t>> counters;
+};
+
+extern Stats stats;
+
+class Timer {
+private:
+    std::chrono::steady_clock::time_point start;
+
+public:
+    Timer(): start(std::chrono::steady_clock::now()) {}
+
+    inline double elapsed() const {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+// times the enclosing scope as one phase
+class Phase {
+private:
+    const char *name;
+    Timer timer;
+
+public:
+    Phase(const char *name): name(name) {}
+    ~Phase() { if (stats.enabled()) stats.time(name, timer.elapsed()); }
+};
@@ -0,0 +1,54 @@
+#include "Symtab.h"
+
+using namespace std;
+
+// FNV-1a
+uint64_t Interner::hash(string_view s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (char ch: s)
+        h = (h ^ uint8_t(ch)) * 1099511628211ULL;
+    return h;
+}
+
+size_t Interner::probe(string_view s, uint64_t h) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        int e = slots[i];
+        if (!e || (hashes[e - 1] == h && strs[e - 1] == s)) return i;
+    }
+}
+
+void Interner::grow() {
+    slots.assign(slots.empty() ? 64 : slots.size() * 2, 0);
+    size_t mask = slots.size() - 1;
+    for (size_t id = 0; id < strs.size(); ++id) {
+        size_t i = hashes[id] & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+}
+
+int Interner::intern(string_view s) {
+    auto h = hash(s);
+    if (!slots.empty()) {
+        int e = slots[probe(s, h)];
+        if (e) return e - 1;
+    }
+    if ((strs.size() + 1) * 4 > slots.size() * 3) grow();
+    int id = strs.size();
+    strs.emplace_back(s);
+    hashes.push_back(h);
+    slots[probe(s, h)] = id + 1;
+    return id;
+}
+
+int Interner::find(string_view s) const {
+    if (slots.empty()) return -1;
+    return slots[probe(s, hash(s))] - 1;
+}
+
+void Interner::clear() {
+    strs.clear();
+    hashes.clear();
+    slots.clear();
+}
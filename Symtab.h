@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// open-addressing hash table from integer keys, such as interned names,
+// to values; it probes linearly over a power-of-two table and keeps the
+// entries in insertion order, so iterating does not depend on hashing.
+// Pointers to values stay valid until the next insertion of a new key
+template <typename K, typename V> class HashMap {
+public:
+    typedef std::pair<K, V> Entry;
+
+private:
+    std::vector<Entry> entries;
+    std::vector<int> slots; // index into entries plus one, 0 if free
+
+    static inline size_t hash(K k) {
+        uint64_t h = uint64_t(k) * 0x9e3779b97f4a7c15ULL;
+        return size_t(h ^ h >> 32);
+    }
+
+    // the slot holding k, or the free one where it belongs
+    size_t probe(K k) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(k) & mask;; i = (i + 1) & mask) {
+            int e = slots[i];
+            if (!e || entries[e - 1].first == k) return i;
+        }
+    }
+
+    void grow() {
+        slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+        for (size_t i = 0; i < entries.size(); ++i)
+            slots[probe(entries[i].first)] = i + 1;
+    }
+
+public:
+    V *find(K k) {
+        if (slots.empty()) return nullptr;
+        int e = slots[probe(k)];
+        return e ? &entries[e - 1].second : nullptr;
+    }
+
+    const V *find(K k) const {
+        return const_cast<HashMap *>(this)->find(k);
+    }
+
+    // the value of k, value-initialized and true if k is new
+    std::pair<V *, bool> insert(K k) {
+        if (auto v = find(k)) return { v, false };
+        if ((entries.size() + 1) * 4 > slots.size() * 3) grow();
+        entries.emplace_back(k, V());
+        slots[probe(k)] = entries.size();
+        return { &entries.back().second, true };
+    }
+
+    inline V &operator[](K k) { return *insert(k).first; }
+
+    // sets k to v unless it is already there, like std::map::emplace
+    bool emplace(K k, const V &v) {
+        auto r = insert(k);
+        if (r.second) *r.first = v;
+        return r.second;
+    }
+
+    void clear() {
+        entries.clear();
+        slots.clear();
+    }
+
+    inline size_t size() const { return entries.size(); }
+    inline bool empty() const { return entries.empty(); }
+    inline typename std::vector<Entry>::iterator begin() { return entries.begin(); }
+    inline typename std::vector<Entry>::iterator end() { return entries.end(); }
+    inline typename std::vector<Entry>::const_iterator begin() const { return entries.begin(); }
+    inline typename std::vector<Entry>::const_iterator end() const { return entries.end(); }
+};
+
+// strings numbered 0, 1, ... in order of first sight, so that the tables
+// above can key on names; str() references stay valid until clear()
+class Interner {
+private:
+    std::deque<std::string> strs;
+    std::vector<uint64_t> hashes;
+    std::vector<int> slots; // id plus one, 0 if free
+
+    static uint64_t hash(std::string_view s);
+    size_t probe(std::string_view s, uint64_t h) const;
+    void grow();
+
+public:
+    int intern(std::string_view s);
+    // -1 if s was never interned
+    int find(std::string_view s) const;
+    void clear();
+
+    inline const std::string &str(int id) const { return strs[id]; }
+    inline size_t size() const { return strs.size(); }
+};
+
+// key of a table over pairs of interned names, such as (dll, symbol)
+inline uint64_t pairKey(int a, int b) {
+    return uint64_t(uint32_t(a)) << 32 | uint32_t(b);
+}
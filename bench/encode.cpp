@@ -0,0 +1,372 @@
+// checks the table-driven x86 encoder of PELib.cpp against the emitters
+// it replaced, byte for byte on every register and a spread of
+// immediates and displacements, then measures how many instructions per
+// second each of them encodes
+//
+// usage: encode [-n rounds]
+// Prints one JSON line per encoder; exits with 1 on the first mismatch.
+
+#include "../PELib.h"
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// the emitters as they were, streaming one byte at a time
+namespace ref {
+
+// REX prefix for a 64-bit operand size (w) and the high registers
+static void rex(int w, int reg, int base) {
+    int b = 0x40 | w << 3 | (reg & 8) >> 1 | (base & 8) >> 3;
+    if (b != 0x40) *curtext << b;
+}
+
+// ModRM (and SIB for esp) with the shortest displacement for m
+static void modrm(int reg, Disp m) {
+    int mod = m.disp == 0 && m.base != ebp ? 0
+            : -128 <= m.disp && m.disp < 128 ? 1 : 2;
+    *curtext << (mod << 6) + ((reg & 7) << 3) + m.base;
+    if (m.base == esp) *curtext << 0x24;
+    if (mod == 1) *curtext << u1(m.disp);
+    else if (mod == 2) *curtext << u4(m.disp);
+}
+
+void nop() { *curtext << 0x90; }
+void ret() { *curtext << 0xc3; }
+void leave() { *curtext << 0xc9; }
+// the register forms take r8d-r15d as well, for 32-bit values in x86-64
+// code; the prefix they need is only emitted for those
+static void rr(int op, reg32 r1, reg32 r2) {
+    rex(0, r2, r1);
+    *curtext << op << 0xc0 + (r1 & 7) + ((r2 & 7) << 3);
+}
+
+static void rm(int op, reg32 r, Mem m) {
+    rex(0, r, 0);
+    *curtext << op;
+    modrm(r, m.val);
+}
+
+// 8-bit immediates are sign-extended
+static void alu(int op, reg32 r, DWORD v) {
+    rex(0, 0, r);
+    if (v < 128 || v >= 0xffffff80)
+        *curtext << 0x83 << 0xc0 + (op << 3) + (r & 7) << u1(v);
+    else
+        *curtext << 0x81 << 0xc0 + (op << 3) + (r & 7) << u4(v);
+}
+
+void mov(reg32 r1, reg32 r2) { rr(0x89, r1, r2); }
+void mov(reg32 r, DWORD v) { rex(0, 0, r); *curtext << 0xb8 + (r & 7) << u4(v); }
+void mov(reg32 r, Address ad) { *curtext << 0xb8 + r << ad; }
+void mov(reg32 r, Ptr p) {
+    if (r == eax) *curtext << 0xa1 << p.val;
+    else *curtext << 0x8b << (r << 3) + 5 << p.val;
+}
+void mov(Ptr p, DWORD v) { *curtext << 0xc7 << 0x05 << p.val << u4(v); }
+void mov(Ptr p, Address ad) { *curtext << 0xc7 << 0x05 << p.val << ad; }
+void mov(Ptr p, reg32 r) {
+    if (r == eax) *curtext << 0xa3 << p.val;
+    else *curtext << 0x89 << (r << 3) + 5 << p.val;
+}
+void mov(reg32 r, Mem m) { rm(0x8b, r, m); }
+void mov(Mem m, reg32 r) { rm(0x89, r, m); }
+void mov(Mem m, DWORD v) { *curtext << 0xc7; modrm(0, m.val); *curtext << u4(v); }
+void add(reg32 r1, reg32 r2) { rr(0x01, r1, r2); }
+void add(reg32 r, DWORD v) {
+    rex(0, 0, r);
+    if (v < 128) *curtext << 0x83 << 0xc0 + (r & 7) << v;
+    else *curtext << 0x81 << 0xc0 + (r & 7) << u4(v);
+}
+void add(reg32 r, Address ad) { *curtext << 0x81 << 0xc0 + r << ad; }
+void add(reg32 r, Mem m) { rm(0x03, r, m); }
+void sub(reg32 r1, reg32 r2) { rr(0x29, r1, r2); }
+void sub(reg32 r, DWORD v) { alu(5, r, v); }
+void sub(reg32 r, Mem m) { rm(0x2b, r, m); }
+void imul(reg32 r1, reg32 r2) {
+    rex(0, r1, r2);
+    *curtext << 0x0f << 0xaf << 0xc0 + (r2 & 7) + ((r1 & 7) << 3);
+}
+void imul(reg32 r, Mem m) { rex(0, r, 0); *curtext << 0x0f << 0xaf; modrm(r, m.val); }
+void imul(reg32 r1, reg32 r2, DWORD v) {
+    rex(0, r1, r2);
+    if (v < 128 || v >= 0xffffff80)
+        *curtext << 0x6b << 0xc0 + (r2 & 7) + ((r1 & 7) << 3) << u1(v);
+    else
+        *curtext << 0x69 << 0xc0 + (r2 & 7) + ((r1 & 7) << 3) << u4(v);
+}
+void cdq() { *curtext << 0x99; }
+void idiv(reg32 r) { rex(0, 0, r); *curtext << 0xf7 << 0xf8 + (r & 7); }
+void idiv(Mem m) { *curtext << 0xf7; modrm(7, m.val); }
+void cmp(reg32 r1, reg32 r2) { rr(0x39, r1, r2); }
+void cmp(reg32 r, Mem m) { rm(0x3b, r, m); }
+static void setcc(int cc, reg8 r) { *curtext << 0x0f << 0x90 + cc << 0xc0 + r; }
+void sete (reg8 r) { setcc(0x4, r); }
+void setne(reg8 r) { setcc(0x5, r); }
+void setl (reg8 r) { setcc(0xc, r); }
+void setle(reg8 r) { setcc(0xe, r); }
+void setg (reg8 r) { setcc(0xf, r); }
+void setge(reg8 r) { setcc(0xd, r); }
+void movzx(reg32 r1, reg8 r2) {
+    rex(0, r1, 0);
+    *curtext << 0x0f << 0xb6 << 0xc0 + r2 + ((r1 & 7) << 3);
+}
+void push(reg32 r) { *curtext << 0x50 + r; }
+void push(DWORD v) { *curtext << 0x68 << u4(v); }
+void push(Address ad) { *curtext << 0x68 << ad; }
+void push(Ptr p) { *curtext << 0xff << 0x35 << p.val; }
+void push(Wrap<reg32> p) { push(ptr[p.val + 0]); }
+void push(Mem m) { *curtext << 0xff; modrm(6, m.val); }
+void call(Ptr p) { *curtext << 0xff << 0x15 << p.val; }
+void call(Address ad) { *curtext << 0xe8 << Address(ad, Rel); }
+void jmp (Ptr p) { *curtext << 0xff << 0x25 << p.val; }
+// rel32 here; Image::link shortens them where the target is close
+void jmp (Address ad) { curtext->jump(0xeb); *curtext << 0xe9 << Address(ad, Rel); }
+void jc  (Address ad) { curtext->jump(0x72); *curtext << 0x0f << 0x82 << Address(ad, Rel); }
+void jnc (Address ad) { curtext->jump(0x73); *curtext << 0x0f << 0x83 << Address(ad, Rel); }
+void jz  (Address ad) { curtext->jump(0x74); *curtext << 0x0f << 0x84 << Address(ad, Rel); }
+void jnz (Address ad) { curtext->jump(0x75); *curtext << 0x0f << 0x85 << Address(ad, Rel); }
+void inc(reg32 r) { *curtext << 0x40 + r; }
+void cmp(reg32 r, DWORD v) {
+    if (r == eax && v >= 128 && v < 0xffffff80)
+        *curtext << 0x3d << u4(v);
+    else
+        alu(7, r, v);
+}
+
+static void modrm(int reg, Disp64 m) {
+    int base = m.base & 7;
+    int mod = m.disp == 0 && base != rbp ? 0
+            : -128 <= m.disp && m.disp < 128 ? 1 : 2;
+    *curtext << (mod << 6) + ((reg & 7) << 3) + base;
+    if (base == rsp) *curtext << 0x24;
+    if (mod == 1) *curtext << u1(m.disp);
+    else if (mod == 2) *curtext << u4(m.disp);
+}
+
+// the displacement is relative to the end of the instruction, which is
+// where the Rel relocation measures from as long as nothing follows it
+static void modrm(int reg, RipDisp m) {
+    *curtext << ((reg & 7) << 3) + 5 << Address(m.ad, Rel);
+}
+
+// 8-bit immediates are sign-extended
+static void alu(int op, reg64 r, DWORD v) {
+    rex(1, 0, r);
+    if (v < 128 || v >= 0xffffff80)
+        *curtext << 0x83 << 0xc0 + (op << 3) + (r & 7) << u1(v);
+    else
+        *curtext << 0x81 << 0xc0 + (op << 3) + (r & 7) << u4(v);
+}
+
+void push(reg64 r) { rex(0, 0, r); *curtext << 0x50 + (r & 7); }
+void pop(reg64 r) { rex(0, 0, r); *curtext << 0x58 + (r & 7); }
+void mov(reg64 r1, reg64 r2) {
+    rex(1, r2, r1);
+    *curtext << 0x89 << 0xc0 + (r1 & 7) + ((r2 & 7) << 3);
+}
+// a 32-bit mov, which clears the upper half
+void mov(reg64 r, DWORD v) { rex(0, 0, r); *curtext << 0xb8 + (r & 7) << u4(v); }
+void mov(reg64 r, Mem64 m) { rex(1, r, m.val.base); *curtext << 0x8b; modrm(r, m.val); }
+void mov(Mem64 m, reg64 r) { rex(1, r, m.val.base); *curtext << 0x89; modrm(r, m.val); }
+void lea(reg64 r, RipMem m) { rex(1, r, 0); *curtext << 0x8d; modrm(r, m.val); }
+void add(reg64 r, DWORD v) { alu(0, r, v); }
+void sub(reg64 r, DWORD v) { alu(5, r, v); }
+void and_(reg64 r, DWORD v) { alu(4, r, v); }
+void call(RipMem m) { *curtext << 0xff; modrm(2, m.val); }
+void jmp (RipMem m) { *curtext << 0xff; modrm(4, m.val); }
+
+}
+
+static vector<DWORD> labels;
+static Address target, slot;
+static size_t checked = 0;
+
+// the bytes of one emitter call, before and after relocation
+static vector<BYTE> encode(const function<void()> &f, size_t &nrelocs) {
+    Buffer b;
+    curtext = &b;
+    f();
+    b.reloc(0x400000, 0x1000);
+    vector<BYTE> out(b.size() * 2);
+    if (b.size() > 0) memcpy(out.data(), b.data(), b.size());
+    b.copy(out.data() + b.size());
+    nrelocs = b.relocs();
+    return out;
+}
+
+static void check(const string &what, const function<void()> &table,
+                  const function<void()> &old) {
+    size_t n1, n2;
+    auto b1 = encode(table, n1), b2 = encode(old, n2);
+    ++checked;
+    if (b1 == b2 && n1 == n2) return;
+    auto hex = [](const vector<BYTE> &b) {
+        string s;
+        char buf[4];
+        for (size_t i = 0; i < b.size() / 2; ++i) {
+            snprintf(buf, sizeof(buf), "%02x ", b[i]);
+            s += buf;
+        }
+        return s;
+    };
+    fprintf(stderr, "mismatch: %s\n  table: %s\n  old:   %s\n",
+        what.c_str(), hex(b1).c_str(), hex(b2).c_str());
+    exit(1);
+}
+
+#define SAME(call) check(#call, [&] { ::call; }, [&] { ref::call; })
+
+static const DWORD imms[] = {
+    0, 1, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x12345678,
+    0x7fffffff, 0x80000000, 0xffffff7f, 0xffffff80, 0xfffffffe, 0xffffffff,
+};
+static const int disps[] = {
+    0, 1, -1, 0x7f, 0x80, -0x80, -0x81, 0x1000, -0x1000, INT_MAX, INT_MIN,
+};
+
+// the operands each emitter is used with: r8d-r15d only where the old
+// emitters gave them a REX prefix, and 32-bit bases only up to edi
+static void exhaustive() {
+    for (int i = 0; i < 16; ++i) {
+        auto r1 = reg32(i);
+        auto q1 = reg64(i);
+        SAME(cdq());
+        SAME(idiv(r1));
+        SAME(push(q1));
+        SAME(pop(q1));
+        SAME(lea(q1, ptr[rip + slot]));
+        for (auto v: imms) {
+            SAME(mov(r1, v));
+            SAME(add(r1, v));
+            SAME(sub(r1, v));
+            SAME(cmp(r1, v));
+            SAME(mov(q1, v));
+            SAME(add(q1, v));
+            SAME(sub(q1, v));
+            SAME(and_(q1, v));
+        }
+        for (int j = 0; j < 16; ++j) {
+            auto r2 = reg32(j);
+            auto q2 = reg64(j);
+            SAME(mov(r1, r2));
+            SAME(add(r1, r2));
+            SAME(sub(r1, r2));
+            SAME(imul(r1, r2));
+            SAME(cmp(r1, r2));
+            SAME(mov(q1, q2));
+            for (auto v: imms) SAME(imul(r1, r2, v));
+            for (auto d: disps) {
+                SAME(mov(q1, ptr[q2 + d]));
+                SAME(mov(ptr[q2 + d], q1));
+            }
+        }
+        for (int j = 0; j < 8; ++j) {
+            auto r2 = reg32(j);
+            SAME(movzx(r1, reg8(j)));
+            for (auto d: disps) {
+                SAME(mov(r1, ptr[r2 + d]));
+                SAME(mov(ptr[r2 + d], r1));
+                SAME(add(r1, ptr[r2 + d]));
+                SAME(sub(r1, ptr[r2 + d]));
+                SAME(imul(r1, ptr[r2 + d]));
+                SAME(cmp(r1, ptr[r2 + d]));
+            }
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        auto r = reg32(i);
+        SAME(mov(r, slot));
+        SAME(mov(r, ptr[slot]));
+        SAME(mov(ptr[slot], r));
+        SAME(add(r, slot));
+        SAME(push(r));
+        SAME(push(ptr[r]));
+        SAME(inc(r));
+        SAME(sete(reg8(i)));
+        SAME(setne(reg8(i)));
+        SAME(setl(reg8(i)));
+        SAME(setle(reg8(i)));
+        SAME(setg(reg8(i)));
+        SAME(setge(reg8(i)));
+        for (auto d: disps) {
+            SAME(idiv(ptr[r + d]));
+            SAME(push(ptr[r + d]));
+            for (auto v: imms) SAME(mov(ptr[r + d], v));
+        }
+    }
+    for (auto v: imms) {
+        SAME(push(v));
+        SAME(mov(ptr[slot], v));
+    }
+    SAME(nop());
+    SAME(ret());
+    SAME(leave());
+    SAME(mov(ptr[slot], target));
+    SAME(push(target));
+    SAME(push(ptr[slot]));
+    SAME(call(ptr[slot]));
+    SAME(call(target));
+    SAME(jmp(ptr[slot]));
+    SAME(jmp(target));
+    SAME(jc(target));
+    SAME(jnc(target));
+    SAME(jz(target));
+    SAME(jnz(target));
+    SAME(call(ptr[rip + slot]));
+    SAME(jmp(ptr[rip + slot]));
+}
+
+// a mix like that of the code generators: frames, locals, calls
+// through import slots, compares and branches
+#define MIX(ns) [&] { \
+    ns::push(ebp); ns::mov(ebp, esp); ns::sub(esp, DWORD(16)); \
+    ns::mov(eax, ptr[ebp + 8]); ns::add(eax, ptr[ebp + 12]); \
+    ns::mov(ptr[ebp - 4], eax); ns::push(slot); ns::call(ptr[slot]); \
+    ns::add(esp, DWORD(4)); ns::cmp(eax, DWORD(1000)); ns::jz(target); \
+    ns::imul(ecx, edx, DWORD(3)); ns::push(rbp); ns::mov(rbp, rsp); \
+    ns::mov(r10, ptr[rbp - 8]); ns::lea(rcx, ptr[rip + slot]); \
+    ns::call(ptr[rip + slot]); ns::leave(); ns::ret(); \
+}
+static const size_t mixsize = 19;
+
+static void measure(const char *name, const function<void()> &mix, size_t rounds) {
+    Buffer b;
+    curtext = &b;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; ++i) {
+        // a function's worth at a time, as the code generators fill text
+        if (b.size() > 65536) b.clear();
+        mix();
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t n = rounds * mixsize;
+    printf("{\"encoder\":\"%s\",\"instructions\":%zu,\"seconds\":%.6f,\"per_second\":%.0f}\n",
+        name, n, secs, n / secs);
+}
+
+int main(int argc, char *argv[]) {
+    size_t rounds = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "-n" && i + 1 < argc)
+            rounds = strtoul(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "usage: %s [-n rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    curlabels = &labels;
+    target = Address(0x401234);
+    slot = Address(0x402000);
+
+    exhaustive();
+    fprintf(stderr, "%zu encodings identical\n", checked);
+    measure("table", MIX(), rounds);
+    measure("reference", MIX(ref), rounds);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// generates a synthetic program for benchmarking inc
+//
+// usage: gen [-c classes] [-f functions] [-k fanout] [-s strings]
+//            [-i imports] outdir
+//
+// outdir receives one file per class (c0.in ...), main.in and imports.in.
+// Class i only calls into class i-1 and imports, so the call graph is
+// acyclic.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+static const char *crt[] = {
+    "puts", "getchar", "putchar", "abs", "labs", "toupper", "tolower",
+    "isalpha", "isdigit", "isspace", "strlen", "atoi", "rand", "srand",
+};
+static const int ncrt = sizeof(crt) / sizeof(crt[0]);
+
+static int classes = 10, functions = 10, fanout = 3, strings = 100, imports = 8;
+
+static string import(int i) {
+    if (i < ncrt) return crt[i];
+    return "bench_fn" + to_string(i);
+}
+
+static FILE *create(const string &path) {
+    auto f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "can not open: %s\n", path.c_str());
+        exit(1);
+    }
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            int v = atoi(argv[++i]);
+            switch (argv[i - 1][1]) {
+            case 'c': classes   = v; break;
+            case 'f': functions = v; break;
+            case 'k': fanout    = v; break;
+            case 's': strings   = v; break;
+            case 'i': imports   = v; break;
+            default:
+                fprintf(stderr, "unknown option: %s\n", argv[i - 1]);
+                return 1;
+            }
+        } else
+            dir = argv[i];
+    }
+    if (!dir || classes < 1 || functions < 1 || imports < 1) {
+        fprintf(stderr, "usage: %s [-c classes] [-f functions] [-k fanout]"
+            " [-s strings] [-i imports] outdir\n", argv[0]);
+        return 1;
+    }
+
+    int str = 0, imp = 0;
+    for (int c = 0; c < classes; ++c) {
+        auto f = create(string(dir) + "/c" + to_string(c) + ".in");
+        fprintf(f, "class c%d\n", c);
+        for (int fn = 0; fn < functions; ++fn) {
+            fprintf(f, "    function f%d(a, b)\n", fn);
+            for (int k = 0; k < fanout; ++k) {
+                fprintf(f, "        ");
+                if (c == 0)
+                    fprintf(f, "%s(", import(imp++ % imports).c_str());
+                else
+                    fprintf(f, "c%d'f%d(", c - 1, (fn + k) % functions);
+                switch (k % 3) {
+                case 0:
+                    fprintf(f, "a, b");
+                    break;
+                case 1:
+                    fprintf(f, "b, %d", c * functions + fn);
+                    break;
+                default:
+                    if (strings > 0)
+                        fprintf(f, "\"message %d\\n\", a", str++ % strings);
+                    else
+                        fprintf(f, "%d, a", k);
+                    break;
+                }
+                fprintf(f, ")\n");
+            }
+            fprintf(f, "    end function\n\n");
+        }
+        fprintf(f, "end class\n");
+        fclose(f);
+    }
+
+    auto f = create(string(dir) + "/main.in");
+    fprintf(f, "function main()\n");
+    for (int fn = 0; fn < functions; ++fn)
+        fprintf(f, "    c%d'f%d(%d, \"main\")\n", classes - 1, fn, fn);
+    fprintf(f, "    return 0\nend function\n");
+    fclose(f);
+
+    f = create(string(dir) + "/imports.in");
+    for (int i = 0; i < imports; ++i)
+        fprintf(f, "import \"%s\" cdecl %s\n",
+            i < ncrt ? "msvcrt.dll" : "bench.dll", import(i).c_str());
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# times inc on synthetic programs of increasing size
+#
+# usage: bench/run.sh [inc] [gen]
+# Each size is generated into a temporary directory and compiled with
+# --stats=json; the result is one JSON line per size on stdout.
+
+INC=$(cd "$(dirname "${1:-./inc.exe}")" && pwd)/$(basename "${1:-./inc.exe}")
+GEN=$(cd "$(dirname "${2:-bench/gen.exe}")" && pwd)/$(basename "${2:-bench/gen.exe}")
+WORK=${TMPDIR:-/tmp}/inc-bench.$$
+trap 'rm -rf "$WORK"' EXIT
+
+# name classes functions fanout strings imports
+SIZES="
+small   10   10  3    100   8
+medium  100  50  4   5000  32
+large   400 100  6  50000 128
+"
+
+echo "$SIZES" | while read name c f k s i; do
+    [ -z "$name" ] && continue
+    rm -rf "$WORK" && mkdir -p "$WORK" || exit 1
+    "$GEN" -c $c -f $f -k $k -s $s -i $i "$WORK" || exit 1
+    (
+        cd "$WORK" || exit 1
+        start=$(date +%s.%N)
+        "$INC" --stats=json c*.in main.in imports.in > /dev/null 2> stats.json || exit 1
+        end=$(date +%s.%N)
+        bytes=$(cat c*.in main.in imports.in | wc -c)
+        printf '{"size":"%s","classes":%d,"functions":%d,"fanout":%d,"strings":%d,"imports":%d,"source_bytes":%d,"wall":%s,"stats":%s}\n' \
+            $name $c $f $k $s $i $bytes \
+            $(echo "$end - $start" | awk '{ printf "%.6f", $1 - $3 }') \
+            "$(cat stats.json)"
+    ) || exit 1
+done
@@ -1,18 +1,55 @@
 #include "PELib.h"
+#include "ELF.h"
+#include "JIT.h"
+#include "Lexer.h"
+#include "Module.h"
+#include "Stats.h"
+#include <algorithm>
 #include <cstdarg>
-#include <list>
-#include <functional>
+#include <climits>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-static PE pe;
+static Image *image;
+static string target = "pe";
+static bool run = false;
+// -o: the output file, "-" for stdout; messages then go to stderr
+static string outpath;
+static FILE *msgs = stdout;
+// --dll-dir: DLL files to take import hints from; --bind prebinds too
+static string dlldir;
+static bool binding = false;
+
+// thrown by die() so that a worker thread can hand its error back to main
+struct Error {
+    string msg;
+};
 
 void vdie(const string &src, int line, int column, const char *format, va_list arg) {
-    if (line > 0)
-        fprintf(stderr, "%s[%d:%d] ", src.c_str(), line, column);
-    vfprintf(stderr, format, arg);
-    fprintf(stderr, "\n");
-    exit(1);
+    char buf[1024];
+    string msg;
+    if (line > 0) {
+        snprintf(buf, sizeof(buf), "%s[%d:%d] ", src.c_str(), line, column);
+        msg = buf;
+    }
+    vsnprintf(buf, sizeof(buf), format, arg);
+    msg += buf;
+    throw Error { msg };
 }
 
 void die(const string &src, int line, int column, const char *format, ...) {
@@ -26,9 +63,10 @@ struct Symbol {
     string src;
     int line = 0, column = 0;
     Address addr;
+    bool dropped = false; // an import left without a thunk by thunks()
 
     void clear() {
-        *addr.addr = 0;
+        *addr = 0;
     }
 
     void die(const char *format, ...) {
@@ -38,130 +76,55 @@ struct Symbol {
         va_end(arg);
     }
 
-    DWORD operator *() const { return *addr.addr; }
+    DWORD operator *() const { return *addr; }
 };
 
-map<string, Symbol> funcs;
+// by the name as interned by the image
+HashMap<int, Symbol> funcs;
 
 Address func(const string &name, const string &src = "", int line = 0, int column = 0) {
-    if (funcs.find(name) == funcs.end()) {
-        Symbol sym;
+    int id = image->intern(name);
+    auto r = funcs.insert(id);
+    auto &sym = *r.first;
+    if (r.second) {
         sym.src = src;
-        sym.addr = pe.sym(name, true);
+        sym.addr = image->sym(id, true);
         sym.line = line;
         sym.column = column;
-        funcs[name] = sym;
     }
-    return funcs[name].addr;
+    return sym.addr;
 }
 
-void link() {
-    puts("linking...");
-    for (auto p: funcs) p.second.clear();
-    pe.link();
-    list<pair<string, Symbol>> syms;
-    for (auto p: funcs) {
-        auto sym = p.second;
-        if (!*sym) sym.die("undefined: %s", p.first.c_str());
-        syms.push_back(p);
-    }
-    syms.sort([](const pair<string, Symbol> &p1, const pair<string, Symbol> &p2) {
-        return *p1.second < *p2.second;
-    });
-    for (auto p: syms)
-        printf("%x: %s\n", *p.second, p.first.c_str());
+// the image binds imports; a target may not provide every function
+Address import(const string &dll, const string &sym) {
+    auto ad = image->import(dll, sym);
+    if (!ad)
+        die("", 0, 0, "%s: import not available for target %s: %s",
+            dll.c_str(), target.c_str(), sym.c_str());
+    return ad;
 }
 
-enum Token { Word, Num, Str, Other };
-
-class Lexer {
-private:
-    FILE *file;
-    int cur = 0;
-    int curline = 1, curcol = 0;
-
-public:
-    string src;
-    Token type = Other;
-    string token;
-    int line = 1, column = 0;
-
-    Lexer(const string &src): src(src) {
-        file = fopen(src.c_str(), "r");
-        readc();
-    }
-
-    ~Lexer() {
-        if (file) fclose(file);
-    }
-
-    int readc() {
-        if (!file) cur = -1;
-        if (cur < 0) return cur;
-        cur = fgetc(file);
-        ++curcol;
-        if (cur == '\n') { ++curline; curcol = 0; }
-        return cur;
-    }
-
-    static bool isalpha(char ch) {
-        return ch == '_'
-            || ('A' <= ch && ch <= 'Z')
-            || ('a' <= ch && ch <= 'z');
-    }
-
-    static bool isnum(char ch) {
-        return '0' <= ch && ch <= '9';
-    }
-
-    static bool isletter(char ch) {
-        return ch == '\'' || isalpha(ch) || isnum(ch);
-    }
-
-    bool read() {
-        while (cur >= 0) {
-            if (isalpha(cur))
-                return read(Word, isletter);
-            else if (isnum(cur))
-                return read(Num, isnum);
-            else if (cur == '"') {
-                int dq = 0;
-                bool esc = false;
-                return read(Str, [&](int ch) {
-                    if (dq == 2)
-                        return false;
-                    else if (esc)
-                        esc = false;
-                    else if (ch == '"')
-                        ++dq;
-                    else if (ch == '\\')
-                        esc = true;
-                    return true;
-                });
-            } else if (cur > ' ') {
-                int c = 0;
-                return read(Other, [&](int) { return c++ < 1; });
-            }
-            readc();
-        }
-        return false;
-    }
-
-private:
-    bool read(Token t, function<bool(int)> f) {
-        line = curline;
-        column = curcol;
-        type = t;
-        token.clear();
-        while (f(cur)) {
-            token += cur;
-            readc();
-        }
-        return true;
+void link() {
+    fputs("linking...\n", msgs);
+    for (auto &p: funcs) p.second.clear();
+    image->link();
+    Phase phase("symbols");
+    vector<pair<DWORD, int>> syms;
+    syms.reserve(funcs.size());
+    for (auto &p: funcs) {
+        if (p.second.dropped) continue;
+        if (!*p.second) p.second.die("undefined: %s", image->name(p.first).c_str());
+        syms.emplace_back(*p.second, p.first);
     }
-};
+    sort(syms.begin(), syms.end(), [](const pair<DWORD, int> &p1, const pair<DWORD, int> &p2) {
+        if (p1.first != p2.first) return p1.first < p2.first;
+        return image->name(p1.second) < image->name(p2.second);
+    });
+    for (auto &p: syms)
+        fprintf(msgs, "%x: %s\n", p.first, image->name(p.second).c_str());
+}
 
-string getstr(string s) {
+string getstr(string_view s) {
     if (s.size() >= 2 && s[0] == '"' && s[s.size() - 1] == '"')
         s = s.substr(1, s.size() - 2);
     string ret;
@@ -188,20 +151,51 @@ string getstr(string s) {
     return ret;
 }
 
-template <typename T> int index(const vector<T> &vec, const T &v) {
+template <typename T, typename U> int index(const vector<T> &vec, const U &v) {
     for (int i = 0; i < vec.size(); ++i)
         if (vec[i] == v) return i;
     return -1;
 }
 
+// value of a literal subexpression; false where it is left to run time,
+// as for division by zero
+static bool fold(Insn::Op op, int x, int y, int &r) {
+    auto ux = unsigned(x), uy = unsigned(y);
+    switch (op) {
+    case Insn::Add: r = int(ux + uy); break;
+    case Insn::Sub: r = int(ux - uy); break;
+    case Insn::Mul: r = int(ux * uy); break;
+    case Insn::Div:
+        if (y == 0 || (x == INT_MIN && y == -1)) return false;
+        r = x / y;
+        break;
+    case Insn::SetEq: r = x == y; break;
+    case Insn::SetNe: r = x != y; break;
+    case Insn::SetLt: r = x < y; break;
+    case Insn::SetLe: r = x <= y; break;
+    case Insn::SetGt: r = x > y; break;
+    case Insn::SetGe: r = x >= y; break;
+    default: return false;
+    }
+    return true;
+}
+
 class Parser {
 private:
+    Module &mod;
     Lexer lexer;
     Token type;
-    string token;
+    string_view token;
+    bool unread = false;
+
+    // of the function being parsed: parameters, locals with their
+    // registers, and which registers hold temporaries
+    vector<string_view> args;
+    vector<pair<string_view, int>> vars;
+    vector<bool> temps;
 
 public:
-    Parser(const string &src): lexer(src) {}
+    Parser(Module &mod): mod(mod), lexer(mod.src) {}
 
     void parse() {
         while (read()) {
@@ -212,7 +206,7 @@ public:
             else if (token == "import")
                 parseImport();
             else
-                die("error: %s", token.c_str());
+                die("error: %s", string(token).c_str());
         }
     }
 
@@ -225,26 +219,73 @@ public:
 
 private:
     bool read() {
-        if (!lexer.read()) return false;
+        if (unread) {
+            unread = false;
+            return true;
+        }
+        if (stats.enabled()) {
+            Timer timer;
+            bool ok = lexer.read();
+            mod.lextime += timer.elapsed();
+            if (!ok) return false;
+        } else if (!lexer.read())
+            return false;
+        ++mod.tokens;
         type = lexer.type;
         token = lexer.token;
         return true;
     }
 
+    int var(string_view name) {
+        for (auto &v: vars)
+            if (v.first == name) return v.second;
+        return -1;
+    }
+
+    int newreg(bool temp) {
+        temps.push_back(temp);
+        return mod.functions.back().nregs++;
+    }
+
+    // the calling convention that token names, or -1
+    int conv() {
+        if (token == "cdecl") return Cdecl;
+        if (token == "stdcall") return Stdcall;
+        if (token == "fastcall") return Fastcall;
+        return -1;
+    }
+
     void parseFunction(const string &prefix = "") {
         if (!read() || type != Word)
             die("function: name required");
-        curtext->put(func(prefix + token));
-        push(ebp);
-        mov(ebp, esp);
-        auto args = parseFunctionArgs();
+        // a convention only when the name follows, so that stdcall(...)
+        // still names the function
+        auto name = token;
+        int c = conv();
+        if (c >= 0) {
+            if (!read())
+                c = -1;
+            else if (type == Word)
+                name = token;
+            else {
+                c = -1;
+                unread = true;
+            }
+        }
+        mod.function(prefix + string(name));
+        mod.emit(Insn::Enter);
+        args = parseFunctionArgs();
+        vars.clear();
+        temps.clear();
+        mod.functions.back().conv = c >= 0 ? Conv(c) : Cdecl;
+        mod.functions.back().nargs = args.size();
         bool epi = false;
         while (read()) {
             if (token == "end") {
                 if (read() && token == "function") {
                     if (!epi) {
-                        leave();
-                        ret();
+                        mod.emit(Insn::Leave);
+                        mod.emit(Insn::Ret);
                     }
                     return;
                 }
@@ -254,32 +295,43 @@ private:
                 int l = lexer.line, c = lexer.column;
                 auto t = token;
                 if (t == "return") {
-                    if (read() && type == Num) {
-                        mov(eax, atoi(token.c_str()));
-                        leave();
-                        ret();
-                        epi = true;
-                        continue;
-                    }
+                    mod.emit(Insn(Insn::MovEax, parseExpr()));
+                    mod.emit(Insn::Leave);
+                    mod.emit(Insn::Ret);
+                    epi = true;
+                    continue;
                 } else if (read()) {
-                    if (token == "(") {
-                        int nargs = parseCallArgs(args);
-                        call(func(t, lexer.src, l, c));
-                        if (nargs > 0) add(esp, 4 * nargs);
+                    // var is only a declaration when a name follows, so
+                    // that var(...) still calls a function
+                    if (t == "var" && type == Word) {
+                        unread = true;
+                        parseVar();
+                        continue;
+                    } else if (token == "(") {
+                        parseCall(t, l, c);
+                        continue;
+                    } else if (token == "=") {
+                        int r = var(t);
+                        if (r < 0)
+                            ::die(lexer.src, l, c, index(args, t) < 0
+                                ? "undefined variable: %s"
+                                : "can not assign to argument: %s",
+                                string(t).c_str());
+                        mod.emit(Insn(Insn::Mov, parseExpr(), r));
                         continue;
                     }
                 }
-                ::die(lexer.src, l, c, "error: %s", t.c_str());
+                ::die(lexer.src, l, c, "error: %s", string(t).c_str());
             } else
-                die("error: %s", token.c_str());
+                die("error: %s", string(token).c_str());
         }
         die("function: 'end function' required");
     }
 
-    vector<string> parseFunctionArgs() {
+    vector<string_view> parseFunctionArgs() {
         if (!read() || token != "(")
             die("function: '(' required");
-        vector<string> args;
+        vector<string_view> args;
         while (read()) {
             if (token == ")")
                 break;
@@ -298,20 +350,34 @@ private:
         return args;
     }
 
-    int parseCallArgs(const vector<string> &fargs) {
-        list<pair<Token, string>> args;
+    // var name [= expr]; the value is computed before name exists
+    void parseVar() {
+        if (!read() || type != Word)
+            die("var: name required");
+        auto name = token;
+        if (var(name) >= 0 || index(args, name) >= 0)
+            die("var: already defined: %s", string(name).c_str());
+        auto v = Operand::imm(0);
+        if (read()) {
+            if (token == "=")
+                v = parseExpr();
+            else
+                unread = true;
+        }
+        int r = newreg(false);
+        vars.emplace_back(name, r);
+        mod.emit(Insn(Insn::Mov, v, r));
+    }
+
+    // arguments are evaluated first to last and pushed last to first, so
+    // that the pushes of a call are never interleaved with another call
+    void parseCall(string_view name, int line, int column) {
+        vector<Operand> vals;
         while (read()) {
             if (token == ")")
                 break;
-            else if (type == Word) {
-                int arg = index(fargs, token);
-                if (arg == -1)
-                    die("undefined variable: %s", token.c_str());
-                args.push_front(make_pair(type, token));
-            } else if (type == Num || type == Str)
-                args.push_front(make_pair(type, token));
-            else
-                die("function: argument required");
+            unread = true;
+            vals.push_back(parseExpr());
             if (read()) {
                 if (token == ")")
                     break;
@@ -320,29 +386,139 @@ private:
             }
             die("function: ',' or ')' required");
         }
-        for (auto p: args) {
-            switch (p.first) {
-            case Word:
-                // TODO: push(ptr[ebp+X]);
-                mov(eax, ebp);
-                add(eax, (index(fargs, p.second) + 2) * 4);
-                push(ptr[eax]);
+        for (auto it = vals.rbegin(); it != vals.rend(); ++it)
+            mod.emit(Insn(Insn::Push, *it));
+        int nargs = vals.size();
+        auto f = mod.func(string(name), line, column);
+        mod.emit(Insn(Insn::Call, Operand::label(f.id), nargs));
+        if (nargs > 0) mod.emit(Insn(Insn::AddEsp, Operand(), 4 * nargs));
+        ++mod.calls;
+    }
+
+    // x op y into a temporary; x is reused if it is one
+    Operand binary(Insn::Op op, Operand x, Operand y) {
+        int v;
+        if (x.kind == Operand::Imm && y.kind == Operand::Imm
+                && fold(op, x.value, y.value, v))
+            return Operand::imm(v);
+        int r;
+        if (x.kind == Operand::Reg && temps[x.value])
+            r = x.value;
+        else {
+            r = newreg(true);
+            mod.emit(Insn(Insn::Mov, x, r));
+        }
+        if (y.kind == Operand::Label || (op == Insn::Div && y.kind == Operand::Imm)) {
+            int t = newreg(true);
+            mod.emit(Insn(Insn::Mov, y, t));
+            y = Operand::reg(t);
+        }
+        mod.emit(Insn(op, y, r));
+        return Operand::reg(r);
+    }
+
+    // compare := sum [op sum]..., sum := term [+- term]...,
+    // term := unary [*/ unary]..., unary := -unary | primary
+    Operand parseExpr() {
+        auto x = parseSum();
+        while (read()) {
+            Insn::Op op;
+            if (token == "<" || token == ">") {
+                bool lt = token == "<";
+                if (!read())
+                    die("expression required");
+                if (token == "=")
+                    op = lt ? Insn::SetLe : Insn::SetGe;
+                else {
+                    unread = true;
+                    op = lt ? Insn::SetLt : Insn::SetGt;
+                }
+            } else if (token == "=" || token == "!") {
+                bool eq = token == "=";
+                if (!read() || token != "=")
+                    die(eq ? "'==' required" : "'!=' required");
+                op = eq ? Insn::SetEq : Insn::SetNe;
+            } else {
+                unread = true;
                 break;
-            case Num:
-                push(atoi(p.second.c_str()));
+            }
+            x = binary(op, x, parseSum());
+        }
+        return x;
+    }
+
+    Operand parseSum() {
+        auto x = parseTerm();
+        while (read()) {
+            if (token != "+" && token != "-") {
+                unread = true;
                 break;
-            case Str:
-                push(pe.str(getstr(p.second)));
+            }
+            auto op = token == "+" ? Insn::Add : Insn::Sub;
+            x = binary(op, x, parseTerm());
+        }
+        return x;
+    }
+
+    Operand parseTerm() {
+        auto x = parseUnary();
+        while (read()) {
+            if (token != "*" && token != "/") {
+                unread = true;
                 break;
             }
+            auto op = token == "*" ? Insn::Mul : Insn::Div;
+            x = binary(op, x, parseUnary());
+        }
+        return x;
+    }
+
+    Operand parseUnary() {
+        if (!read()) die("expression required");
+        if (token != "-") {
+            unread = true;
+            return parsePrimary();
         }
-        return args.size();
+        return binary(Insn::Sub, Operand::imm(0), parseUnary());
+    }
+
+    Operand parsePrimary() {
+        if (!read()) die("expression required");
+        if (type == Num)
+            return Operand::imm(atoi(string(token).c_str()));
+        if (type == Str)
+            return Operand::label(mod.str(getstr(token)).id);
+        if (token == "(") {
+            auto x = parseExpr();
+            if (!read() || token != ")")
+                die("')' required");
+            return x;
+        }
+        if (type != Word)
+            die("expression required: %s", string(token).c_str());
+        int l = lexer.line, c = lexer.column;
+        auto name = token;
+        if (read()) {
+            if (token == "(") {
+                parseCall(name, l, c);
+                int r = newreg(true);
+                mod.emit(Insn(Insn::Result, Operand(), r));
+                return Operand::reg(r);
+            }
+            unread = true;
+        }
+        int r = var(name);
+        if (r >= 0) return Operand::reg(r);
+        int arg = index(args, name);
+        if (arg < 0)
+            ::die(lexer.src, l, c, "undefined variable: %s", string(name).c_str());
+        return Operand::arg(arg);
     }
 
     void parseClass() {
         if (!read() || type != Word)
             die("class: name required");
-        auto name = token;
+        auto name = string(token);
         while (read()) {
             if (token == "end") {
                 if (read() && token == "class") return;
@@ -350,7 +526,7 @@ private:
             } else if (token == "function")
                 parseFunction(name + "'");
             else
-                die("error: %s", token.c_str());
+                die("error: %s", string(token).c_str());
         }
     }
 
@@ -360,32 +536,452 @@ private:
         auto dll = getstr(token);
         if (!read() || type != Word)
             die("import: calling convention required");
-        if (token != "cdecl")
-            die("import: not supported: %s", token.c_str());
+        int c = conv();
+        if (c < 0)
+            die("import: not supported: %s", string(token).c_str());
         if (!read() || type != Word)
             die("import: function name required");
-        curtext->put(func(token));
-        jmp(ptr[pe.import(dll, token)]);
+        mod.import(dll, string(token), Conv(c));
     }
 };
 
-int main(int argc, char *argv[]) {
-    pe.select();
+string cachedir;
+atomic<size_t> cached(0);
+bool compileonly = false;
+
+// cache entry for the contents of src: FNV-1a over the bytes; the
+// entry also records the format version, so stale ones fail to load
+static string cachefile(const string &src) {
+    Source file(src);
+    uint64_t h = 14695981039346656037ULL;
+    for (auto p = file.begin(); p != file.end(); ++p)
+        h = (h ^ BYTE(*p)) * 1099511628211ULL;
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.inc", (unsigned long long)h);
+    return cachedir + "/" + name;
+}
+
+static bool readfile(const string &path, string &out) {
+    auto f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        out.append(buf, n);
+    fclose(f);
+    return true;
+}
+
+// the export tables of the imported DLLs from --dll-dir, whose file
+// names match without regard to case as on Windows; imports from a DLL
+// that is not there keep hint 0 and stay unbound
+static void loadExports(PE &pe) {
+    auto lower = [](string s) {
+        for (auto &ch: s) ch = tolower(BYTE(ch));
+        return s;
+    };
+    map<string, string> files;
+    error_code ec;
+    for (filesystem::directory_iterator it(dlldir, ec), end; !ec && it != end; it.increment(ec))
+        files[lower(it->path().filename().string())] = it->path().string();
+    if (ec) die("", 0, 0, "can not read: %s", dlldir.c_str());
+
+    set<string> dlls;
+    for (auto &imp: image->slots()) dlls.insert(imp.dll);
+    for (auto &dll: dlls) {
+        auto file = files.find(lower(dll));
+        if (file == files.end()) {
+            fprintf(stderr, "%s: not found in %s\n", dll.c_str(), dlldir.c_str());
+            continue;
+        }
+        string data;
+        Exports table;
+        if (!readfile(file->second, data) || !table.read(data))
+            die("", 0, 0, "not a DLL: %s", file->second.c_str());
+        if (!pe.exports(dll, move(table)))
+            die("", 0, 0, "%s: not a DLL for target %s", file->second.c_str(), target.c_str());
+    }
+    pe.bind(binding);
+}
+
+// written aside and renamed, so that a concurrent reader never sees
+// half an entry; the aside name is unique to the process and thread, as
+// other compilers may share the directory
+static bool writefile(const string &path, const string &data) {
+    auto tmp = path + "." + to_string(getpid()) + "."
+             + to_string(hash<thread::id>()(this_thread::get_id()));
+    auto f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = fclose(f) == 0 && ok;
+    error_code ec;
+    if (ok) filesystem::rename(tmp, path, ec);
+    if (!ok || ec) filesystem::remove(tmp, ec);
+    return ok && !ec;
+}
+
+// objects written by -c hold the same bytes as cache entries
+static bool isobject(const string &src) {
+    return src.size() > 2 && src.compare(src.size() - 2, 2, ".o") == 0;
+}
+
+static string objectfile(const string &src) {
+    auto base = src;
+    if (base.size() > 3 && base.compare(base.size() - 3, 3, ".in") == 0)
+        base.resize(base.size() - 3);
+    return base + ".o";
+}
+
+void parse(Module &mod) {
+    Timer timer;
+    mod.select();
+    string path, data;
+    if (isobject(mod.src)) {
+        if (!readfile(mod.src, data))
+            mod.error = "can not open: " + mod.src;
+        else if (!mod.load(data))
+            mod.error = mod.src + ": not an object of this version";
+        mod.time = timer.elapsed();
+        return;
+    }
+    if (!cachedir.empty()) {
+        path = cachefile(mod.src);
+        auto src = mod.src;
+        if (readfile(path, data) && mod.load(data)) {
+            mod.src = src;
+            ++cached;
+            mod.time = timer.elapsed();
+            return;
+        }
+        mod = Module(mod.src);
+        mod.select();
+    }
+    try {
+        Parser(mod).parse();
+    } catch (const Error &e) {
+        mod.error = e.msg;
+    }
+    if (!path.empty() && mod.error.empty()) {
+        data.clear();
+        mod.save(data);
+        writefile(path, data);
+    }
+    mod.time = timer.elapsed();
+}
+
+// runs f on every module, spread over jobs threads
+template <typename F> void parallel(vector<Module> &mods, int jobs, F f) {
+    if (jobs <= 1 || mods.size() <= 1) {
+        for (auto &mod: mods) f(mod);
+        return;
+    }
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int i = 0; i < jobs && i < mods.size(); ++i)
+        workers.emplace_back([&] {
+            for (size_t j; (j = next++) < mods.size();)
+                f(mods[j]);
+        });
+    for (auto &w: workers) w.join();
+}
+
+map<string, string> imported;
+map<string, Conv> convs;
+bool peephole = true;
+size_t inlining = 8;
+bool gc = true, gcreport = false;
+set<string> keptstrs;
+set<pair<string, string>> keptimports;
+
+void codegen(vector<Module> &mods, int jobs) {
+    Phase phase("codegen");
+    parallel(mods, jobs, [](Module &mod) {
+        if (peephole) mod.optimize();
+        mod.lower(imported, convs, image->abi());
+    });
+}
+
+// resolve the externs of mod against the global tables in the order the
+// module first used them, so the result does not depend on threading;
+// externs that the generated code does not use are left out
+void merge(Module &mod) {
+    vector<int> map(mod.labels.size(), -1);
+    auto used = mod.text.referenced(mod.labels.size());
+    for (auto &f: mod.functions) used[f.label] = true;
+    for (auto &e: mod.externs) {
+        if (!used[e.label]) continue;
+        Address ad;
+        switch (e.kind) {
+        case Module::Func:
+            ad = func(e.name, !e.src.empty() ? e.src : e.line > 0 ? mod.src : "",
+                      e.line, e.column);
+            break;
+        case Module::Str:
+            ad = image->str(e.name);
+            keptstrs.insert(e.name);
+            break;
+        case Module::Import:
+            ad = import(e.dll, e.name);
+            keptimports.emplace(e.dll, e.name);
+            break;
+        }
+        map[e.label] = ad.id;
+    }
+    for (int i = 0; i < map.size(); ++i)
+        if (map[i] < 0) map[i] = Address(mod.labels[i]).id;
+    curtext->append(mod.text, map);
+}
+
+// an import keeps a jmp thunk only if its address is taken; otherwise it
+// is not a function of its own. Imports shadowed by a function are not
+// in imported, so their name stays the function's
+void thunks() {
+    auto used = curtext->referenced(curlabels->size());
+    for (auto &imp: imported) {
+        auto sym = funcs.find(image->intern(imp.first));
+        if (!sym) continue;
+        if (used[sym->addr.id]) {
+            curtext->put(sym->addr);
+            auto slot = import(imp.second, imp.first);
+            if (image->wide())
+                jmp(ptr[rip + slot]);
+            else
+                jmp(ptr[slot]);
+            keptimports.emplace(imp.second, imp.first);
+        } else
+            sym->dropped = true;
+    }
+}
+
+// --print-gc-sections
+void report(const vector<Module> &mods, const vector<pair<string, string>> &removed) {
+    for (auto &r: removed)
+        fprintf(stderr, "removing unused function '%s' in file '%s'\n",
+            r.second.c_str(), r.first.c_str());
+    set<string> strs;
+    for (auto &mod: mods)
+        for (auto &e: mod.externs)
+            if (e.kind == Module::Str && !keptstrs.count(e.name)
+                    && strs.insert(e.name).second)
+                fprintf(stderr, "removing unused literal \"%s\" in file '%s'\n",
+                    e.name.c_str(), mod.src.c_str());
+    for (auto &imp: imported)
+        if (!keptimports.count(make_pair(imp.second, imp.first)))
+            fprintf(stderr, "removing unused import '%s' from '%s'\n",
+                imp.first.c_str(), imp.second.c_str());
+}
+
+int main(int argc, char *argv[]) try {
+    Timer total;
+    int jobs = thread::hardware_concurrency();
+    vector<Module> mods;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.size() > 2 && arg.compare(0, 2, "-j") == 0)
+            jobs = atoi(arg.c_str() + 2);
+        else if (arg == "-j" && i + 1 < argc)
+            jobs = atoi(argv[++i]);
+        else if (arg == "-O0") {
+            peephole = false;
+            inlining = 0;
+        } else if (arg.compare(0, 9, "--inline=") == 0)
+            inlining = atoi(arg.c_str() + 9);
+        else if (arg == "--gc-sections")
+            gc = true;
+        else if (arg == "--no-gc-sections")
+            gc = false;
+        else if (arg == "--print-gc-sections")
+            gcreport = true;
+        else if (arg == "--stats" || arg == "--stats=text")
+            stats.format = Stats::Text;
+        else if (arg == "--stats=json")
+            stats.format = Stats::Json;
+        else if (arg.compare(0, 9, "--target=") == 0)
+            target = arg.substr(9);
+        else if (arg == "--run")
+            run = true;
+        else if (arg == "-c")
+            compileonly = true;
+        else if (arg.compare(0, 8, "--cache=") == 0)
+            cachedir = arg.substr(8);
+        else if (arg.compare(0, 10, "--dll-dir=") == 0)
+            dlldir = arg.substr(10);
+        else if (arg == "--bind")
+            binding = true;
+        else if (arg.size() > 2 && arg.compare(0, 2, "-o") == 0)
+            outpath = arg.substr(2);
+        else if (arg == "-o" && i + 1 < argc)
+            outpath = argv[++i];
+        else
+            mods.emplace_back(arg);
+    }
+    if (outpath == "-") {
+        msgs = stderr;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    if (binding && dlldir.empty())
+        die("", 0, 0, "--bind needs --dll-dir");
+    unique_ptr<Image> img;
+    if (target == "pe")
+        img.reset(new PE);
+    else if (target == "pe64")
+        img.reset(new PE(Win64));
+    else if (target == "elf32")
+        img.reset(new ELF);
+    else if (target == "elf64")
+        img.reset(new ELF(SysV));
+    else
+        die("", 0, 0, "unknown target: %s", target.c_str());
+    image = img.get();
+    auto peimage = dynamic_cast<PE *>(image);
+    if (!dlldir.empty() && !peimage)
+        die("", 0, 0, "--dll-dir needs a PE target");
+
+    if (!cachedir.empty()) {
+        error_code ec;
+        filesystem::create_directories(cachedir, ec);
+        if (ec) die("", 0, 0, "can not create: %s", cachedir.c_str());
+    }
+    {
+        Phase phase("frontend");
+        parallel(mods, jobs, parse);
+    }
+    // what a called name refers to, decided once for inlining, gc and
+    // lowering alike: a function defined in some module shadows imports
+    // of its name, the first of which wins otherwise. Functions take the
+    // convention of their last definition, as in linking
+    map<string, const Module::Imported *> imports;
+    for (auto &mod: mods) {
+        if (!mod.error.empty()) throw Error { mod.error };
+        for (auto &imp: mod.imported) imports.emplace(imp.sym, &imp);
+    }
+    for (auto &mod: mods)
+        for (auto &f: mod.functions) {
+            imports.erase(f.name);
+            if (f.conv == Cdecl) convs.erase(f.name);
+            else convs[f.name] = f.conv;
+        }
+    for (auto &p: imports) {
+        auto &imp = *p.second;
+        imported.emplace(imp.sym, imp.dll);
+        if (imp.conv == Cdecl) continue;
+        convs[imp.sym] = imp.conv;
+        // the stubs of the ELF targets are cdecl
+        if (!peimage)
+            die("", 0, 0, "import %s: only cdecl on ELF targets",
+                imp.sym.c_str());
+    }
+    if (compileonly) {
+        size_t nsrcs = 0;
+        for (auto &mod: mods) nsrcs += !isobject(mod.src);
+        if (!outpath.empty() && nsrcs != 1)
+            die("", 0, 0, "-o with -c needs exactly one source");
+        for (auto &mod: mods) {
+            if (isobject(mod.src)) continue;
+            string data;
+            mod.save(data);
+            auto obj = outpath.empty() ? objectfile(mod.src) : outpath;
+            bool ok = obj == "-"
+                ? fwrite(data.data(), 1, data.size(), stdout) == data.size()
+                : writefile(obj, data);
+            if (!ok) die("", 0, 0, "can not write: %s", obj.c_str());
+            fprintf(msgs, "output: %s\n", obj.c_str());
+        }
+        return 0;
+    }
+    if (inlining > 0) {
+        Phase phase("inline");
+        inlineCalls(mods, inlining);
+    }
+    vector<pair<string, string>> removed;
+    if (gc) {
+        Phase phase("gc");
+        removed = removeUnreachable(mods, "main");
+    }
+    codegen(mods, jobs);
+    if (stats.enabled()) {
+        // lexing is interleaved with parsing, so these are summed per file
+        for (auto &mod: mods) {
+            stats.time("lex", mod.lextime);
+            stats.time("parse", mod.time - mod.lextime);
+            stats.count("files", 1);
+            stats.count("tokens", mod.tokens);
+            stats.count("functions", mod.functions.size());
+            stats.count("calls", mod.calls);
+            stats.count("inlined", mod.inlined);
+        }
+        // functions as parsed, gc's removals included
+        stats.count("functions", removed.size());
+        stats.count("functions.removed", removed.size());
+        if (!cachedir.empty()) stats.count("cached", cached);
+    }
+
+    image->select();
 
     curtext->put(func("_start"));
-    call(func("main"));
-    push(eax);
-    call(ptr[pe.import("msvcrt.dll", "exit")]);
+    if (image->wide()) {
+        // Linux enters with rsp aligned, Windows as if called
+        and_(rsp, DWORD(-16));
+        sub(rsp, DWORD(32));
+        call(func("main"));
+        mov(image->abi() == Win64 ? rcx : rdi, rax);
+        call(ptr[rip + import("msvcrt.dll", "exit")]);
+    } else {
+        call(func("main"));
+        push(eax);
+        call(ptr[import("msvcrt.dll", "exit")]);
+    }
     jmp(curtext->addr());
 
-    for (int i = 1; i < argc; ++i)
-        Parser(argv[i]).parse();
+    {
+        Phase phase("merge");
+        for (auto &mod: mods)
+            merge(mod);
+        thunks();
+    }
+    if (gcreport) report(mods, removed);
+    if (!dlldir.empty()) {
+        Phase phase("exports");
+        loadExports(*peimage);
+    }
     link();
 
-    auto exe = "output.exe";
-    auto f = fopen(exe, "wb");
-    if (!f) die("", 0, 0, "can not open: %s", exe);
-    pe.write(f);
-    fclose(f);
-    printf("output: %s\n", exe);
+    if (run) {
+        // the program ends the process, so the statistics come first
+        if (stats.enabled()) {
+            stats.time("total", total.elapsed());
+            stats.print(stderr);
+        }
+        fflush(stdout);
+        JIT jit;
+        if (!jit.load(*image) || !jit.run(*func("_start")))
+            die("", 0, 0, "%s", jit.error.c_str());
+        return 0;
+    }
+
+    bool pe = target.compare(0, 2, "pe") == 0;
+    auto exe = !outpath.empty() ? outpath : pe ? "output.exe" : "output";
+    if (exe == "-") {
+        if (!image->write(stdout) || fflush(stdout) != 0)
+            die("", 0, 0, "can not write: stdout");
+    } else {
+        auto f = fopen(exe.c_str(), "wb");
+        if (!f) die("", 0, 0, "can not open: %s", exe.c_str());
+        bool ok = image->write(f);
+        if (fclose(f) != 0 || !ok) die("", 0, 0, "can not write: %s", exe.c_str());
+#ifndef _WIN32
+        if (!pe) chmod(exe.c_str(), 0755);
+#endif
+    }
+    fprintf(msgs, "output: %s\n", exe.c_str());
+
+    if (stats.enabled()) {
+        stats.time("total", total.elapsed());
+        stats.print(stderr);
+    }
+} catch (const Error &e) {
+    fprintf(stderr, "%s\n", e.msg.c_str());
+    return 1;
 }
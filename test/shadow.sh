@@ -0,0 +1,38 @@
+#!/bin/sh
+# a function defined in one file shadows an import of its name in
+# another; inlining must not change which one a call reaches
+#
+# usage: test/shadow.sh [inc] [target]
+# The target must run on this host (elf64 by default); exits non-zero
+# if the optimization settings disagree.
+
+INC=$(cd "$(dirname "${1:-./inc.exe}")" && pwd)/$(basename "${1:-./inc.exe}")
+TARGET=${2:-elf64}
+WORK=${TMPDIR:-/tmp}/inc-test.$$
+trap 'rm -rf "$WORK"' EXIT
+mkdir -p "$WORK" && cd "$WORK" || exit 1
+
+cat > a.in <<'IN'
+import "msvcrt.dll" cdecl putchar
+function puts(s)
+    putchar(88)
+    putchar(10)
+end function
+IN
+cat > b.in <<'IN'
+import "msvcrt.dll" cdecl puts
+function main()
+    puts("real")
+    return 0
+end function
+IN
+
+for opt in -O0 --inline=0 --no-gc-sections ""; do
+    "$INC" --target=$TARGET $opt -o out a.in b.in > /dev/null || exit 1
+    ./out > got || exit 1
+    if [ "$(cat got)" != X ]; then
+        echo "shadow: $TARGET ${opt:-default}: got '$(cat got)', expected 'X'"
+        exit 1
+    fi
+done
+echo "shadow: ok"